@@ -22,40 +22,74 @@
 #ifndef BF_FILLER_HPP
 #define BF_FILLER_HPP
 
-#include "bloomtree.hpp"
-#include "simpleBF.hpp"
+#include "kmer_index.hpp"
+#include "kmer_utils.hpp"
+#include <iostream>
 #include <memory>
 #include <string>
 #include <vector>
 
 using namespace std;
 
-class BloomfilterFiller {
+// Batch of genes, the first one is gene first of the index
+struct gene_batch_t {
+  size_t first;
+  vector<pair<string, vector<uint64_t>>> *genes;
+};
+
+// Numbers the batches, it must be a serial_in_order filter. The genes must
+// be the ones of the legend the index was created with, in order.
+class GeneCounter {
 public:
-  BloomfilterFiller(SSBT *_sbt, int& _counter, const vector<SimpleBF *> &_leaves)
-      : sbt(_sbt), counter(_counter), leaves(_leaves) {}
+  GeneCounter(int& _counter, const vector<string> &_legend)
+      : counter(_counter), legend(_legend) {}
 
-  void operator()(vector<pair<string, vector<size_t>>> *genes) const {
+  gene_batch_t *operator()(vector<pair<string, vector<uint64_t>>> *genes) const {
+    for (size_t i = 0; i < genes->size(); ++i)
+      if (counter + i >= legend.size() || (*genes)[i].first != legend[counter + i]) {
+        cerr << "shark: the reference does not match the sequence names read before"
+             << " (is its .fai index out of date?)" << endl
+             << "aborting..." << endl;
+        exit(EXIT_FAILURE);
+      }
+    gene_batch_t *batch = new gene_batch_t{(size_t)counter, genes};
+    counter += genes->size();
+    return batch;
+  }
 
-    SimpleBF *node;
-    for (const auto &gene : *genes) {
-      node = leaves[counter];
+private:
+  int& counter;
+  const vector<string> &legend;
+};
 
-      while (node) {
-        for (const auto position : gene.second) {
-          node->add_at(position);
-        }
+// Adds the batches to the index, in parallel if the index allows it. The
+// keys of a hashed index are hashed here, one gene at a time, and each
+// gene is released as soon as it is added.
+class BloomfilterFiller {
+public:
+  BloomfilterFiller(KmerIndex *_index, int _nHash)
+      : index(_index), nHash(_nHash) {}
 
-        node = node->get_parent();
+  void operator()(gene_batch_t *batch) const {
+    static thread_local vector<size_t> positions;
+    for (size_t i = 0; i < batch->genes->size(); ++i) {
+      vector<uint64_t> &keys = (*batch->genes)[i].second;
+      if (!index->hashed()) {
+        index->add(batch->first + i, keys);
+      } else {
+        positions.resize(keys.size() * nHash);
+        for (size_t j = 0; j < keys.size(); ++j)
+          _get_hash(&positions[j * nHash], nHash, keys[j], index->blocked());
+        index->add(batch->first + i, positions);
       }
-      ++counter;
+      vector<uint64_t>().swap(keys);
     }
-    delete genes;
+    delete batch->genes;
+    delete batch;
   }
 
 private:
-  SSBT const *sbt;
-  int& counter;
-  const vector<SimpleBF *> &leaves;
+  KmerIndex *index;
+  int nHash;
 };
 #endif
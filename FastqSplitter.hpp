@@ -32,13 +32,16 @@
 
 using namespace std;
 
+// Reads the samples in batches of maxnum reads (or pairs of mates), taken
+// from the pool. The strings of the reads are copied once, in the arena of
+// the batch; the spans not kept are empty.
 class FastqSplitter {
 public:
 
-  typedef vector<elem_t> output_t;
+  typedef read_batch_t output_t;
 
-  FastqSplitter(kseq_t * const _seq1, kseq_t * const _seq2, const int _maxnum, const char _min_quality, const bool _full_mode)
-    : seq1(_seq1), seq2(_seq2), maxnum(_maxnum), min_quality(_min_quality), full_mode(_full_mode), empty_el({})
+  FastqSplitter(ReadBatchPool &_pool, kseq_t * const _seq1, kseq_t * const _seq2, const int _maxnum, const char _min_quality, const bool _full_mode)
+    : pool(_pool), seq1(_seq1), seq2(_seq2), maxnum(_maxnum), min_quality(_min_quality), full_mode(_full_mode)
   {
   }
 
@@ -46,73 +49,60 @@ public:
   }
 
   output_t* operator()(tbb::flow_control &fc) const {
-    output_t* const fastq = new output_t();
-    fastq->reserve(maxnum);
-    int seq_len1, seq_len2;
-    if (min_quality == 0) {
-      if (seq2 == nullptr) {
-        while (fastq->size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0) {
-          fastq->push_back({
-            seq1->seq.s,
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              empty_el }
-          });
-        }
-      } else {
-        while (fastq->size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0 && (seq_len2 = kseq_read(seq2)) >= 0) {
-          fastq->push_back({
-            string(seq1->seq.s) + "N" + string(seq2->seq.s),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              { seq2->name.s, full_mode ? seq2->seq.s : "", full_mode ? seq2->qual.s : "" } }
-          });
-        }
-      }
-    } else {
-      const char mq = min_quality + 33;
-      if (seq2 == nullptr) {
-        while (fastq->size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0) {
-          fastq->push_back({
-            mask_seq(seq1->seq.s, seq1->qual.s, seq1->qual.l, mq),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              empty_el }
-          });
-        }
-      } else {
-        while (fastq->size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0 && (seq_len2 = kseq_read(seq2)) >= 0) {
-          fastq->push_back({
-            mask_seq(
-              string(seq1->seq.s) + "N" + string(seq2->seq.s),
-              string(seq1->qual.s) + "\33" + string(seq2->qual.s),
-              mq
-            ),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              { seq2->name.s, full_mode ? seq2->seq.s : "", full_mode ? seq2->qual.s : "" } }
-          });
-        }
-      }
+    read_batch_t* const batch = pool.get();
+    while (batch->reads.size() < maxnum && kseq_read(seq1) >= 0 && (seq2 == nullptr || kseq_read(seq2) >= 0)) {
+      add_read(*batch);
     }
-    if(fastq->size() > 0) return fastq;
+    if(batch->reads.size() > 0) return batch;
     fc.stop();
-    delete fastq;
+    pool.put(batch);
     return nullptr;
   }
 private:
+  ReadBatchPool &pool;
   kseq_t * const seq1;
   kseq_t * const seq2;
   const size_t maxnum;
   const char min_quality;
   const bool full_mode;
-  const sharseq_t empty_el;
 
-  static string mask_seq(string seq, const char* const qual, const size_t l, const char min_quality) {
-    for (size_t i = 0; i < l; ++i) {
-      if (qual[i] < min_quality) seq[i] = seq[i] - 64;
+  void add_read(read_batch_t &batch) const {
+    read_t read = {};
+    vector<char> &arena = batch.arena;
+    read.seq.offset = arena.size();
+    arena.insert(arena.end(), seq1->seq.s, seq1->seq.s + seq1->seq.l);
+    if (seq2 != nullptr) {
+      arena.push_back('N');
+      arena.insert(arena.end(), seq2->seq.s, seq2->seq.s + seq2->seq.l);
+    }
+    read.seq.length = arena.size() - read.seq.offset;
+    arena.push_back('\0');
+    if (min_quality > 0) {
+      const char mq = min_quality + 33;
+      char *const seq = batch.data(read.seq);
+      mask_seq(seq, seq1, mq);
+      if (seq2 != nullptr) {
+        seq[seq1->seq.l] -= 64; // the N joining the mates has quality \33
+        mask_seq(seq + seq1->seq.l + 1, seq2, mq);
+      }
+    }
+
+    kseq_t * const mates[2] = {seq1, seq2};
+    for (int i = 0; i < 2 && mates[i] != nullptr; ++i) {
+      read.id[i] = batch.append(mates[i]->name.s, mates[i]->name.l);
+      if (full_mode) {
+        read.bases[i] = batch.append(mates[i]->seq.s, mates[i]->seq.l);
+        read.qual[i] = batch.append(mates[i]->qual.s, mates[i]->qual.l);
+      }
     }
-    return seq;
+    batch.reads.push_back(read);
   }
 
-  static string mask_seq(string seq, const string& qual, const char min_quality) {
-    return mask_seq(seq, qual.c_str(), qual.length(), min_quality);
+  static void mask_seq(char* const seq, const kseq_t* const mate, const char min_quality) {
+    const char* const qual = mate->qual.s;
+    for (size_t i = 0; i < mate->qual.l && i < mate->seq.l; ++i) {
+      if (qual[i] < min_quality) seq[i] = seq[i] - 64;
+    }
   }
 };
 
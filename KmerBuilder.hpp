@@ -29,53 +29,55 @@
 
 using namespace std;
 
+// Outputs the keys of every gene (canonical k-mers, or minimizers if m > 0),
+// one word each; they are hashed by BloomfilterFiller.
 class KmerBuilder {
 
 public:
-  KmerBuilder(size_t _k, uint64_t _bf_size, int _nHash)
-      : k(_k), bf_size(_bf_size), nHash(_nHash) {}
+  KmerBuilder(size_t _k, uint _m = 0) : k(_k), m(_m) {}
 
-  vector<pair<string, vector<size_t>>> *
+  vector<pair<string, vector<uint64_t>>> *
   operator()(vector<pair<string, string>> *texts) const {
     if (texts) {
-      vector<pair<string, vector<size_t>>> *ret =
-          new vector<pair<string, vector<size_t>>>();
-      vector<size_t> hash(nHash);
+      vector<pair<string, vector<uint64_t>>> *ret =
+          new vector<pair<string, vector<uint64_t>>>();
       uint64_t kmer, rckmer, key;
 
       for (const auto &p : *texts) {
         vector<uint64_t> kmer_pos;
-        if (p.second.size() >= k) {
+        if (m > 0) {
+          // One key per super-k-mer
+          for_each_super_kmer(p.second, k, m, [&](const uint64_t key, int, int) {
+            kmer_pos.push_back(key);
+          });
+        } else if (p.second.size() >= k) {
           int _pos = 0;
           kmer = build_kmer(p.second, _pos, k);
-          if (kmer == (uint64_t)-1)
-            continue;
-          rckmer = revcompl(kmer, k);
-          key = min(kmer, rckmer);
-
-          _get_hash(hash, key);
-
-          kmer_pos.insert(kmer_pos.end(), hash.begin(), hash.end());
-          for (int pos = _pos; pos < (int)p.second.size(); ++pos) {
-            uint8_t new_char = to_int[p.second[pos]];
-            if (new_char == 0) { // Found a char different from A, C, G, T
-              ++pos; // we skip this character then we build a new kmer
-              kmer = build_kmer(p.second, pos, k);
-              if (kmer == (uint64_t)-1)
-                break;
-              rckmer = revcompl(kmer, k);
-              --pos; // p must point to the ending position of the kmer, it will
-                     // be incremented by the for
-            } else {
-              --new_char; // A is 1 but it should be 0
-              kmer = lsappend(kmer, new_char, k);
-              rckmer = rsprepend(rckmer, reverse_char(new_char), k);
-            }
+          // A gene without k-mers keeps its place, its id is the one in the legend
+          if (kmer != (uint64_t)-1) {
+            rckmer = revcompl(kmer, k);
             key = min(kmer, rckmer);
 
-            _get_hash(hash, key);
+            kmer_pos.push_back(key);
+            for (int pos = _pos; pos < (int)p.second.size(); ++pos) {
+              uint8_t new_char = to_int[p.second[pos]];
+              if (new_char == 0) { // Found a char different from A, C, G, T
+                ++pos; // we skip this character then we build a new kmer
+                kmer = build_kmer(p.second, pos, k);
+                if (kmer == (uint64_t)-1)
+                  break;
+                rckmer = revcompl(kmer, k);
+                --pos; // p must point to the ending position of the kmer, it will
+                       // be incremented by the for
+              } else {
+                --new_char; // A is 1 but it should be 0
+                kmer = lsappend(kmer, new_char, k);
+                rckmer = rsprepend(rckmer, reverse_char(new_char), k);
+              }
+              key = min(kmer, rckmer);
 
-            kmer_pos.insert(kmer_pos.end(), hash.begin(), hash.end());
+              kmer_pos.push_back(key);
+            }
           }
         }
         ret->emplace_back(p.first, std::move(kmer_pos));
@@ -88,8 +90,7 @@ public:
 
 private:
   size_t k;
-  uint64_t bf_size;
-  int nHash;
+  uint m; // minimizer length, 0 for k-mers
 };
 
 #endif
@@ -0,0 +1,252 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MAPPED_FASTQ_SPLITTER_HPP
+#define MAPPED_FASTQ_SPLITTER_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "common.hpp"
+#include "mapped_file.hpp"
+
+#include <tbb/pipeline.h>
+
+using namespace std;
+
+/**
+ * Cuts samples mapped in memory (FASTQ with 4-line records) in batches,
+ * parsed afterwards by FastqParser. A single sample is cut every CHUNK
+ * bytes, and every batch takes the records starting in its chunk, found by
+ * the parser itself. Mates must stay in lockstep, so paired samples are
+ * cut every maxnum records instead, by counting lines, which is the only
+ * pass over the bytes in the serial stage.
+ **/
+class MappedFastqSplitter {
+public:
+  static const size_t CHUNK = 1 << 23;
+
+  MappedFastqSplitter(ReadBatchPool &_pool, const MappedFile &_sample1,
+                      const MappedFile *const _sample2, const size_t _maxnum)
+    : pool(_pool), maxnum(_maxnum), paired(_sample2 != nullptr), done(false)
+  {
+    pos[0] = reinterpret_cast<const char *>(_sample1.data());
+    end[0] = pos[0] + _sample1.size();
+    pos[1] = paired ? reinterpret_cast<const char *>(_sample2->data()) : nullptr;
+    end[1] = paired ? pos[1] + _sample2->size() : nullptr;
+  }
+
+  read_batch_t *operator()(tbb::flow_control &fc) const {
+    if (pos[0] == end[0] || done) {
+      fc.stop();
+      return nullptr;
+    }
+    read_batch_t *const batch = pool.get();
+    for (int i = 0; i < 1 + paired; ++i)
+      batch->chunks[i].begin = pos[i];
+    if (paired) {
+      for (int i = 0; i < 2; ++i)
+        pos[i] = skip_lines(pos[i], end[i], 4 * maxnum);
+      // The mate with fewer records ends the sample
+      done = pos[0] == end[0] || pos[1] == end[1];
+    } else {
+      pos[0] += min(CHUNK, (size_t)(end[0] - pos[0]));
+      batch->resync = true;
+    }
+    for (int i = 0; i < 1 + paired; ++i)
+      batch->chunks[i].end = pos[i];
+    return batch;
+  }
+
+private:
+  ReadBatchPool &pool;
+  const size_t maxnum;
+  const bool paired;
+  mutable const char *pos[2]; // of the next batch
+  const char *end[2];
+  mutable bool done;
+
+  static const char *skip_lines(const char *p, const char *const end, size_t n) {
+    for (; n > 0 && p < end; --n) {
+      const char *const nl = static_cast<const char *>(memchr(p, '\n', end - p));
+      p = nl == nullptr ? end : nl + 1;
+    }
+    return p;
+  }
+};
+
+/**
+ * Parses the records of the chunks of a batch. The records are not copied:
+ * only the sequence to analyze and the ids go in the arena of the batch,
+ * the bases and qualities of a matched read are written from the mapping.
+ * When the batch starts in the middle of a record (resync), it starts from
+ * the first line starting with @ whose second next line starts with +: a
+ * quality line can start with @, but it is then followed by a header and a
+ * sequence.
+ **/
+class FastqParser {
+public:
+  FastqParser(const MappedFile &sample1, const MappedFile *const sample2,
+              const char _min_quality, const bool _full_mode)
+    : min_quality(_min_quality), full_mode(_full_mode)
+  {
+    start[0] = reinterpret_cast<const char *>(sample1.data());
+    end[0] = start[0] + sample1.size();
+    start[1] = sample2 != nullptr ? reinterpret_cast<const char *>(sample2->data()) : nullptr;
+    end[1] = sample2 != nullptr ? start[1] + sample2->size() : nullptr;
+  }
+
+  read_batch_t *operator()(read_batch_t *batch) const {
+    const bool paired = batch->chunks[1].begin != nullptr;
+    const char *p[2] = {batch->chunks[0].begin, batch->chunks[1].begin};
+    if (batch->resync && p[0] != start[0])
+      p[0] = resync(p[0]);
+    record_t mates[2];
+    while (p[0] < batch->chunks[0].end) {
+      for (int i = 0; i < 1 + paired; ++i)
+        parse(p[i], end[i], mates[i]);
+      if (mates[0].header.data == nullptr || (paired && mates[1].header.data == nullptr))
+        break;
+      add_read(*batch, mates, paired);
+    }
+    return batch;
+  }
+
+  // Whether all the records of the sample take 4 lines, checked before
+  // mapping it since a multi-line record cannot be told apart from the
+  // middle of a chunk
+  static bool parsable(const MappedFile &file) {
+    const char *p = reinterpret_cast<const char *>(file.data());
+    const char *const e = p + file.size();
+    record_t record;
+    do {
+      if (!parse(p, e, record))
+        return false;
+    } while (record.header.data != nullptr);
+    return true;
+  }
+
+private:
+  // Lines of a record, without their newlines
+  struct record_t {
+    str_view_t header;
+    str_view_t seq;
+    str_view_t qual;
+  };
+
+  const char *start[2];
+  const char *end[2];
+  const char min_quality;
+  const bool full_mode;
+
+  // Line starting at p, and the start of the next one
+  static str_view_t line(const char *&p, const char *const end) {
+    const char *const nl = static_cast<const char *>(memchr(p, '\n', end - p));
+    str_view_t l = {p, (size_t)((nl == nullptr ? end : nl) - p)};
+    p = nl == nullptr ? end : nl + 1;
+    if (l.length > 0 && l.data[l.length - 1] == '\r')
+      --l.length;
+    return l;
+  }
+
+  const char *resync(const char *p) const {
+    const char *const e = end[0];
+    if (p[-1] != '\n')
+      line(p, e);
+    while (p < e) {
+      const char *const header = p;
+      line(p, e);
+      const char *q = p;
+      line(q, e);
+      if (*header == '@' && q < e && *q == '+')
+        return header;
+    }
+    return e;
+  }
+
+  // Parses the record at p, with a null header at the end of the sample,
+  // and moves p to the next one. Returns false if the record does not take
+  // 4 lines.
+  static bool parse(const char *&p, const char *const end, record_t &record) {
+    while (p < end && (*p == '\n' || *p == '\r'))
+      ++p;
+    record.header.data = nullptr;
+    if (p == end)
+      return true;
+    record.header = line(p, end);
+    record.seq = line(p, end);
+    const str_view_t plus = line(p, end);
+    record.qual = line(p, end);
+    return record.header.data[0] == '@' && plus.length > 0 && plus.data[0] == '+' &&
+           record.seq.length == record.qual.length;
+  }
+
+  void add_read(read_batch_t &batch, const record_t *const mates, const bool paired) const {
+    read_t read = {};
+    vector<char> &arena = batch.arena;
+    read.seq.offset = arena.size();
+    arena.insert(arena.end(), mates[0].seq.data, mates[0].seq.data + mates[0].seq.length);
+    if (paired) {
+      arena.push_back('N');
+      arena.insert(arena.end(), mates[1].seq.data, mates[1].seq.data + mates[1].seq.length);
+    }
+    read.seq.length = arena.size() - read.seq.offset;
+    arena.push_back('\0');
+    if (min_quality > 0) {
+      const char mq = min_quality + 33;
+      char *const seq = batch.data(read.seq);
+      mask_seq(seq, mates[0], mq);
+      if (paired) {
+        seq[mates[0].seq.length] -= 64; // the N joining the mates has quality \33
+        mask_seq(seq + mates[0].seq.length + 1, mates[1], mq);
+      }
+    }
+
+    for (int i = 0; i < 1 + paired; ++i) {
+      // The id ends at the first blank, as in kseq
+      const str_view_t &header = mates[i].header;
+      size_t length = 1;
+      while (length < header.length && header[length] != ' ' && header[length] != '\t')
+        ++length;
+      read.id[i] = batch.append(header.data + 1, length - 1);
+      if (full_mode) {
+        read.mapped_bases[i] = mates[i].seq;
+        read.mapped_qual[i] = mates[i].qual;
+      }
+    }
+    batch.reads.push_back(read);
+  }
+
+  static void mask_seq(char *const seq, const record_t &mate, const char min_quality) {
+    for (size_t i = 0; i < mate.qual.length; ++i)
+      if (mate.qual[i] < min_quality) seq[i] = seq[i] - 64;
+  }
+};
+
+// Uncompressed FASTQ with records of 4 lines, which can be mapped in
+// memory. Other samples, e.g. with multi-line records, are read by kseq.
+inline bool is_mapped_fastq(const MappedFile &file) {
+  return file.is_open() && file.data()[0] == '@' && FastqParser::parsable(file);
+}
+
+#endif
@@ -22,83 +22,140 @@
 #ifndef READANALYZER_HPP
 #define READANALYZER_HPP
 
-#include "bloomtree.hpp"
+#include "kmer_index.hpp"
 #include "common.hpp"
 #include "kmer_utils.hpp"
+#include <algorithm>
 #include <array>
-#include <map>
 #include <vector>
 
 using namespace std;
 
 class ReadAnalyzer {
 public:
-  typedef vector<assoc_t> output_t;
+  typedef read_batch_t output_t;
 
-  ReadAnalyzer(SSBT *tree, const vector<string> &_legend_ID, uint _k, double _c,
+  ReadAnalyzer(KmerIndex *index, const vector<string> &_legend_ID, uint _k, double _c,
                bool _only_single = false, std::string _method = "base",
-               int nHash = 1)
-      : _tree(tree), legend_ID(_legend_ID), k(_k), c(_c),
-        only_single(_only_single), method(_method), _nHash(nHash) {}
-
-  output_t *operator()(vector<elem_t> *reads) const {
-    output_t *associations = new output_t();
-    vector<int> best_genes;
-    typedef pair<pair<unsigned int, unsigned int>, unsigned int> gene_cov_t;
-    map<int, gene_cov_t> classification_id;
-
-    vector<int> genes_tree;
-    vector<size_t> hash_tree(_nHash);
-
-    for (const auto &p : *reads) {
-      classification_id.clear();
-      const string &read_seq = p.first;
+               int nHash = 1, query_stats_t *stats = nullptr, uint m = 0)
+      : _index(index), legend_ID(_legend_ID), k(_k), c(_c),
+        only_single(_only_single), by_kmers(_method == "kmer"), _nHash(nHash),
+        _stats(stats), _m(m) {}
+
+  // Dispatches to a kernel specialized on k and on the method, the
+  // generic kernel (K = 0) handles the other values of k. The
+  // associations are added to the batch, which goes on to the output.
+  output_t *operator()(read_batch_t *reads) const {
+    switch (k) {
+    case 17: return analyze<17>(reads);
+    case 21: return analyze<21>(reads);
+    case 25: return analyze<25>(reads);
+    case 31: return analyze<31>(reads);
+    default: return analyze<0>(reads);
+    }
+  }
+
+private:
+  template <uint K> output_t *analyze(read_batch_t *reads) const {
+    return by_kmers ? analyze<K, true>(reads) : analyze<K, false>(reads);
+  }
+
+  template <uint K, bool BY_KMERS>
+  output_t *analyze(read_batch_t *reads) const {
+    const uint k = K > 0 ? K : this->k;
+    vector<association_t> &associations = reads->associations;
+    static thread_local vector<int> best_genes;
+
+    // Scratch space of the queries, reused across batches
+    static thread_local read_query_t query;
+    uint64_t kmers = 0;
+    query.k = k;
+    query.nHash = _nHash;
+    query.by_bases = !BY_KMERS;
+    query.probes = 0;
+    NtHashRoller roller(k);
+
+    for (size_t r = 0; r < reads->reads.size(); ++r) {
+      const str_view_t read_seq = reads->view(reads->reads[r].seq);
       unsigned int len = 0;
       for (unsigned int pos = 0; pos < read_seq.size(); ++pos)
         len += to_int[read_seq[pos]] > 0 ? 1 : 0;
       // cout<<read_seq<<endl; // FASE 2
+      query.kmers.clear();
+      query.ends.clear();
+      query.hits.clear();
+      query.runs.clear();
+      query.rolled.clear();
       if (len >= k) {
-        int pos = 0;
-        uint64_t kmer = build_kmer(read_seq, pos, k);
-        if (kmer == (uint64_t)-1)
-          continue;
-        uint64_t rckmer = revcompl(kmer, k);
-
-        _tree->get_genes(min(kmer, rckmer), genes_tree, hash_tree);
-
-        int n = genes_tree.size();
-        for (int i = 0; i < n; i++) {
-          auto &gene_cov = classification_id[genes_tree[i]];
-          gene_cov.first.first += min(k, pos - gene_cov.second);
-          gene_cov.first.second = 1;
-          gene_cov.second = pos - 1;
-        }
-
-        for (; pos < (int)read_seq.size(); ++pos) {
-          uint8_t new_char = to_int[read_seq[pos]];
-          if (new_char == 0) {
-            ++pos;
-            kmer = build_kmer(read_seq, pos, k);
-            if (kmer == (uint64_t)-1)
-              break;
-            rckmer = revcompl(kmer, k);
-            --pos;
-          } else {
-            --new_char;
-            kmer = lsappend(kmer, new_char, k);
-            rckmer = rsprepend(rckmer, reverse_char(new_char), k);
+        if (_m > 0) {
+          // One key per super-k-mer, scored as all its k-mers unless the
+          // index checks them
+          for_each_super_kmer(read_seq, k, _m, [&](const uint64_t key, const int end, const int run) {
+            query.kmers.push_back(key);
+            query.ends.push_back(end);
+            query.runs.push_back(run);
+          });
+          query.run_kmers.clear();
+          if (_index->checks_kmers())
+            for_each_kmer(read_seq, k, [&](const uint64_t kmer, int) { query.run_kmers.push_back(kmer); });
+        } else {
+          // A rolling hash family is updated along the read with the
+          // k-mers, instead of hashing every k-mer in the index
+          const bool roll = HashFamily::rolling && _index->hashed();
+          int pos = 0;
+          uint64_t kmer = build_kmer(read_seq, pos, k);
+          if (kmer == (uint64_t)-1)
+            continue;
+          uint64_t rckmer = revcompl(kmer, k);
+          if (roll) {
+            roller.reset(kmer, rckmer);
+            query.rolled.resize(read_seq.size()); // a k-mer at most per base
           }
-
-          _tree->get_genes(min(kmer, rckmer), genes_tree, hash_tree);
-
-          int n = genes_tree.size();
-          for (int i = 0; i < n; i++) {
-            auto &gene_cov = classification_id[genes_tree[i]];
-            gene_cov.first.first += min(k, pos - gene_cov.second);
-            gene_cov.first.second += 1;
-            gene_cov.second = pos;
+          uint64_t *rolled = query.rolled.data();
+
+          query.kmers.push_back(min(kmer, rckmer));
+          query.ends.push_back(pos - 1);
+          if (roll)
+            *rolled++ = roller.hash(kmer, rckmer);
+
+          for (; pos < (int)read_seq.size(); ++pos) {
+            uint8_t new_char = to_int[read_seq[pos]];
+            if (new_char == 0) {
+              ++pos;
+              kmer = build_kmer(read_seq, pos, k);
+              if (kmer == (uint64_t)-1)
+                break;
+              rckmer = revcompl(kmer, k);
+              if (roll)
+                roller.reset(kmer, rckmer);
+              --pos;
+            } else {
+              --new_char;
+              if (roll)
+                roller.roll(new_char, kmer >> (2 * k - 2));
+              kmer = lsappend(kmer, new_char, k);
+              rckmer = rsprepend(rckmer, reverse_char(new_char), k);
+            }
+
+            query.kmers.push_back(min(kmer, rckmer));
+            query.ends.push_back(pos);
+            if (roll)
+              *rolled++ = roller.hash(kmer, rckmer);
           }
+          if (roll)
+            query.rolled.resize(query.kmers.size());
+
+          query.runs.assign(query.kmers.size(), 1);
         }
+
+        // Genes that cannot reach the threshold are never reported, so
+        // the traversal prunes them
+        query.min_score = query.by_bases ? c * len : c * (len - k + 1);
+        _index->get_genes(query);
+        for (const auto run : query.runs)
+          kmers += run;
+        sort(query.hits.begin(), query.hits.end(),
+             [](const gene_hit_t &a, const gene_hit_t &b) { return a.gene < b.gene; });
       }
 
       // IF (FASE 2) COMMENT FROM HERE
@@ -106,61 +163,55 @@ public:
       unsigned int maxk = 0;
       unsigned int max = 0;
       best_genes.clear();
-      if (method == "kmer") {
-        for (auto it = classification_id.cbegin();
-             it != classification_id.cend(); ++it) {
-          if (it->second.first.second == maxk) {
-            best_genes.push_back(it->first);
-          } else if (it->second.first.second > maxk) {
+      if (BY_KMERS) {
+        for (const auto &hit : query.hits) {
+          if (hit.kmers == maxk) {
+            best_genes.push_back(hit.gene);
+          } else if (hit.kmers > maxk) {
             best_genes.clear();
-            maxk = it->second.first.second;
-            best_genes.push_back(it->first);
+            maxk = hit.kmers;
+            best_genes.push_back(hit.gene);
           }
         }
         if (maxk >= c * (len - k + 1) &&
             (!only_single || best_genes.size() == 1))
           for (const auto idx : best_genes)
-            associations->push_back({legend_ID[idx], std::move(get<1>(p))});
+            associations.push_back({r, &legend_ID[idx]});
       } else {
-        for (auto it = classification_id.cbegin();
-             it != classification_id.cend(); ++it) {
-          if (it->second.first.first == max &&
-              it->second.first.second == maxk) {
-            best_genes.push_back(it->first);
-          } else if (it->second.first.first > max ||
-                     (it->second.first.first == max &&
-                      it->second.first.second > maxk)) {
+        for (const auto &hit : query.hits) {
+          if (hit.bases == max && hit.kmers == maxk) {
+            best_genes.push_back(hit.gene);
+          } else if (hit.bases > max ||
+                     (hit.bases == max && hit.kmers > maxk)) {
             best_genes.clear();
-            max = it->second.first.first;
-            maxk = it->second.first.second;
-            best_genes.push_back(it->first);
+            max = hit.bases;
+            maxk = hit.kmers;
+            best_genes.push_back(hit.gene);
           }
         }
         if (max >= c * len && (!only_single || best_genes.size() == 1))
           for (const auto idx : best_genes)
-            associations->push_back({legend_ID[idx], std::move(get<1>(p))});
+            associations.push_back({r, &legend_ID[idx]});
       }
 
       // IF (FASE 2) COMMENT UNTIL HERE
     }
-    delete reads;
-
-    if (associations->size())
-      return associations;
-    else {
-      delete associations;
-      return NULL;
+    if (_stats != nullptr) {
+      _stats->kmers += kmers;
+      _stats->probes += query.probes;
     }
+    return reads;
   }
 
-private:
-  SSBT *const _tree;
+  KmerIndex *const _index;
   const vector<string> &legend_ID;
   const uint k;
   const double c;
   const bool only_single;
-  const std::string method;
+  const bool by_kmers; // method is kmer, otherwise base
   int _nHash;
+  query_stats_t *const _stats;
+  const uint _m; // minimizer length, 0 for k-mers
 };
 
 #endif
@@ -22,40 +22,110 @@
 #ifndef READOUTPUT__HPP
 #define READOUTPUT__HPP
 
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <vector>
+#include <unistd.h>
+#include "bgzf.hpp"
 #include "common.hpp"
 
-class ReadOutput {
+using namespace std;
+
+// Formats the associations of a batch, and the matched reads if asked, in
+// the output buffers of the batch, compressed in BGZF blocks if asked. It
+// runs in parallel, after ReadAnalyzer.
+class ReadFormatter {
 public:
-  ReadOutput(FILE* const _out1 = nullptr, FILE* const _out2 = nullptr)
-    : out1(_out1), out2(_out2)
+  ReadFormatter(const bool _mate1, const bool _mate2, const bool _bgzf = false)
+    : mate1(_mate1), mate2(_mate2), bgzf(_bgzf)
   { }
 
-  void operator()(std::vector<assoc_t> *associations) const {
+  read_batch_t *operator()(read_batch_t *batch) const {
 	// IF (FASE 2) COMMENT FROM HERE
-	
-    if(associations) {
-      string previd = "";
-      for(const auto & a : *associations) {
-        const sharseq_t& s1 = a.second.first;
-        const sharseq_t& s2 = a.second.second;
-        printf("%s %s\n", s1.id.c_str(), a.first.c_str());
-        if (out1 != nullptr && previd != s1.id)
-          fprintf(out1, "@%s\n%s\n+\n%s\n", s1.id.c_str(), s1.seq.c_str(), s1.qual.c_str());
-        if (out2 != nullptr && previd != s1.id)
-          fprintf(out2, "@%s\n%s\n+\n%s\n", s2.id.c_str(), s2.seq.c_str(), s2.qual.c_str());
-        previd = std::move(s1.id);
-      }
-      delete associations;
+
+    size_t prev = batch->reads.size();
+    for(const auto & a : batch->associations) {
+      const read_t &read = batch->reads[a.read];
+      vector<char> &text = batch->text[0];
+      append(text, batch->view(read.id[0]));
+      text.push_back(' ');
+      append(text, {a.gene->data(), a.gene->size()});
+      text.push_back('\n');
+      if (mate1 && prev != a.read)
+        format_fastq(batch->text[1], *batch, read, 0);
+      if (mate2 && prev != a.read)
+        format_fastq(batch->text[2], *batch, read, 1);
+      prev = a.read;
     }
-	
+
 	// IF (FASE 2) COMMENT UNTIL HERE
+    if (bgzf)
+      for (auto &text : batch->text) {
+        static thread_local vector<char> blocks;
+        blocks.clear();
+        bgzf_compress(text, blocks);
+        text.swap(blocks);
+      }
+    return batch;
   }
 
 private:
-  FILE* const out1;
-  FILE* const out2;
+  const bool mate1;
+  const bool mate2;
+  const bool bgzf;
+
+  static void append(vector<char> &text, const str_view_t &s) {
+    text.insert(text.end(), s.data, s.data + s.length);
+  }
+
+  // Rebuilds the record of a mate from its id, bases and qualities
+  static void format_fastq(vector<char> &text, const read_batch_t &batch, const read_t &read, const int mate) {
+    const bool mapped = read.mapped_bases[mate].data != nullptr;
+    text.push_back('@');
+    append(text, batch.view(read.id[mate]));
+    text.push_back('\n');
+    append(text, mapped ? read.mapped_bases[mate] : batch.view(read.bases[mate]));
+    text.insert(text.end(), {'\n', '+', '\n'});
+    append(text, mapped ? read.mapped_qual[mate] : batch.view(read.qual[mate]));
+    text.push_back('\n');
+  }
+};
+
+// Writes the output buffers of the batches in order, with a write per
+// buffer, then gives the batches back to the pool. Nothing else writes to
+// the files through stdio.
+class ReadOutput {
+public:
+  ReadOutput(ReadBatchPool &_pool, FILE* const _out1 = nullptr, FILE* const _out2 = nullptr)
+    : pool(_pool), out{stdout, _out1, _out2}
+  { }
+
+  void operator()(read_batch_t *batch) const {
+    for (int i = 0; i < 3; ++i)
+      if (out[i] != nullptr)
+        write_all(out[i], batch->text[i]);
+    pool.put(batch);
+  }
+
+private:
+  ReadBatchPool &pool;
+  FILE* const out[3]; // associations, mates
+
+  static void write_all(FILE* const file, const vector<char> &text) {
+    const int fd = fileno(file);
+    for (size_t done = 0; done < text.size();) {
+      const ssize_t n = write(fd, text.data() + done, text.size() - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        cerr << "shark: cannot write the output" << endl << "aborting..." << endl;
+        exit(EXIT_FAILURE);
+      }
+      done += n;
+    }
+  }
 };
 
 #endif
@@ -22,22 +22,33 @@
 #ifndef _ARGUMENT_PARSER_HPP_
 #define _ARGUMENT_PARSER_HPP_
 
+#include <cmath>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <vector>
 #include <getopt.h>
 
 static const char *USAGE_MESSAGE =
 "Usage: shark -r <references> -1 <sample1> [OPTIONAL ARGUMENTS]\n"
+"       shark -i <index> -1 <sample1> [OPTIONAL ARGUMENTS]\n"
+"       shark index -r <references> -i <index> [OPTIONAL ARGUMENTS]\n"
+"       shark index -i <index> [-a <references>] [-d <names>] [OPTIONAL ARGUMENTS]\n"
+"       shark merge -i <index> <shard index> <shard index>... [OPTIONAL ARGUMENTS]\n"
 "\n"
 "Arguments:\n"
 "      -r, --reference                   reference sequences in FASTA format (can be gzipped)\n"
+"      -i, --index                       index built by \"shark index\" (used instead of -r), or written by \"shark merge\"\n"
 "      -1, --sample1                     sample in FASTQ (can be gzipped)\n"
+"      -a, --add                         with \"shark index\", add the sequences of this FASTA to the index (can be gzipped)\n"
+"      -d, --remove                      with \"shark index\", remove from the index the genes named in this file, one per line\n"
 "\n"
 "Optional arguments:\n"
 "      -h, --help                        display this help and exit\n"
 "      -2, --sample2                     second sample in FASTQ (optional, can be gzipped)\n"
 "      -o, --out1                        first output sample in FASTQ (default: sharked_sample.1)\n"
 "      -p, --out2                        second output sample in FASTQ (default: sharked_sample.2)\n"
+"      -g, --bgzf                        compress the associations and the output samples with BGZF, in parallel (readable by gzip)\n"
 "      -k, --kmer-size                   size of the kmers to index (default:17, max:31)\n"
 "      -c, --confidence                  confidence for associating a read to a gene (default:0.6)\n"
 "      -b, --bf-size                     bloom filter size in Kb (default:1024)\n"
@@ -46,14 +57,28 @@ static const char *USAGE_MESSAGE =
 "      -t, --threads                     number of threads (default:1)\n"
 "      -m, --method                      subject of the condition [base / kmer] (default: base)\n"
 "      -x, --xxhash                      number of hash functions\n"
+"      -f, --bf-type                     bloom filter type [simple / blocked] (default: simple)\n"
+"      -z, --bits-per-kmer               size every node of the tree by the k-mers below it, with this many bits per k-mer, instead of using -b (default: 0, i.e., -b)\n"
+"      -P, --fpr                         target false positive rate of every node, sets -z from -x (default: 0, i.e., -z)\n"
+"      -M, --max-memory                  memory budget of the tree in MB: picks -z and -x, with -P as the target (default: 0, i.e., no budget)\n"
+"      -T, --topology                    pairing of the genes in the tree [fifo / similarity] (default: fifo)\n"
+"      -e, --engine                      query engine [ssbt / bitsliced / exact] (default: ssbt)\n"
+"      -w, --minimizer                   key the index on minimizers of this length instead of k-mers, requires -e exact (default: 0, i.e., k-mers)\n"
 "      -v, --verbose                     verbose mode\n";
 
 namespace opt {
+  static bool build_index = false;
+  static bool merge = false;
+  static std::vector<std::string> shard_paths;
   static std::string fasta_path = "";
+  static std::string index_path = "";
+  static std::string add_path = "";
+  static std::string remove_path = "";
   static std::string sample1_path = "";
   static std::string sample2_path = "";
   static std::string out1_path = "";
   static std::string out2_path = "";
+  static bool bgzf = false;
   static bool paired_flag = false;
   static uint k = 17;
   static double c = 0.6;
@@ -62,19 +87,30 @@ namespace opt {
   static bool single = false;
   static std::string method = "";
   static int nHash = 1;
+  static std::string bf_type = "simple";
+  static double bits_per_kmer = 0;
+  static double fpr = 0;
+  static uint64_t max_memory = 0;
+  static std::string topology = "fifo";
+  static std::string engine = "ssbt";
+  static uint minimizer = 0;
   static bool verbose = false;
   static int nThreads = 1;
 }
 
-static const char *shortopts = "t:r:1:2:o:p:k:c:b:q:m:x:y:svh";
+static const char *shortopts = "t:r:i:a:d:1:2:o:p:k:c:b:q:m:x:f:T:e:w:y:z:P:M:sgvh";
 
 static const struct option longopts[] = {
   {"reference", required_argument, NULL, 'r'},
+  {"index", required_argument, NULL, 'i'},
+  {"add", required_argument, NULL, 'a'},
+  {"remove", required_argument, NULL, 'd'},
   {"threads", required_argument, NULL, 't'},
   {"sample1", required_argument, NULL, '1'},
   {"sample2", required_argument, NULL, '2'},
   {"out1", required_argument, NULL, 'o'},
   {"out2", required_argument, NULL, 'p'},
+  {"bgzf", no_argument, NULL, 'g'},
   {"kmer-size", required_argument, NULL, 'k'},
   {"confidence", required_argument, NULL, 'c'},
   {"bf-size", required_argument, NULL, 'b'},
@@ -82,18 +118,41 @@ static const struct option longopts[] = {
   {"single", no_argument, NULL, 's'},
   {"method", required_argument, NULL, 'm'},
   {"xxhash", required_argument, NULL, 'x'},
+  {"bf-type", required_argument, NULL, 'f'},
+  {"bits-per-kmer", required_argument, NULL, 'z'},
+  {"fpr", required_argument, NULL, 'P'},
+  {"max-memory", required_argument, NULL, 'M'},
+  {"topology", required_argument, NULL, 'T'},
+  {"engine", required_argument, NULL, 'e'},
+  {"minimizer", required_argument, NULL, 'w'},
   {"verbose", no_argument, NULL, 'v'},
   {"help", no_argument, NULL, 'h'},
   {NULL, 0, NULL, 0}
 };
 
 void parse_arguments(int argc, char **argv) {
+  if (argc > 1 && (std::string(argv[1]) == "index" || std::string(argv[1]) == "merge")) {
+    opt::build_index = true;
+    opt::merge = std::string(argv[1]) == "merge";
+    --argc;
+    ++argv;
+  }
+
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1; ) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'r':
       arg >> opt::fasta_path;
       break;
+    case 'i':
+      arg >> opt::index_path;
+      break;
+    case 'a':
+      arg >> opt::add_path;
+      break;
+    case 'd':
+      arg >> opt::remove_path;
+      break;
     case 't':
       arg >> opt::nThreads;
       if(opt::nThreads <= 0) {
@@ -158,6 +217,9 @@ void parse_arguments(int argc, char **argv) {
     case 's':
       opt::single = true;
       break;
+    case 'g':
+      opt::bgzf = true;
+      break;
     case 'm':
       arg >> opt::method;
       break;
@@ -170,6 +232,65 @@ void parse_arguments(int argc, char **argv) {
         exit(EXIT_FAILURE);
       }
 	  break;
+    case 'f':
+      arg >> opt::bf_type;
+      if(opt::bf_type != "simple" && opt::bf_type != "blocked") {
+        std::cerr << "shark: bloom filter type must be simple or blocked." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'z':
+      arg >> opt::bits_per_kmer;
+      if(opt::bits_per_kmer < 0) {
+        std::cerr << "shark: the bits per k-mer cannot be negative." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'P':
+      arg >> opt::fpr;
+      if(opt::fpr <= 0 || opt::fpr >= 1) {
+        std::cerr << "shark: the false positive rate must be between 0 and 1." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'M':
+      int64_t mb;
+      arg >> mb;
+      if(!arg || mb <= 0) {
+        std::cerr << "shark: the memory budget must be a positive number of MB." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      opt::max_memory = mb;
+      break;
+    case 'T':
+      arg >> opt::topology;
+      if(opt::topology != "fifo" && opt::topology != "similarity") {
+        std::cerr << "shark: topology must be fifo or similarity." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'e':
+      arg >> opt::engine;
+      if(opt::engine != "ssbt" && opt::engine != "bitsliced" && opt::engine != "exact") {
+        std::cerr << "shark: engine must be ssbt, bitsliced or exact." << std::endl
+                  << "aborting..." << std::endl;
+        std::cerr << USAGE_MESSAGE;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      arg >> opt::minimizer;
+      break;
     case 'v':
       opt::verbose = true;
       break;
@@ -183,12 +304,83 @@ void parse_arguments(int argc, char **argv) {
     }
   }
 
-  if (opt::fasta_path == "" || opt::sample1_path == "") {
+  // Bits per k-mer of a bloom filter with nHash hash functions and the
+  // target false positive rate: fpr = (1 - e^(-nHash / bits))^nHash
+  // (with a budget they are chosen when building)
+  if (opt::bits_per_kmer > 0 && (opt::fpr > 0 || opt::max_memory > 0)) {
+    std::cerr << "shark: -z cannot be used with -P or -M." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (opt::fpr > 0 && opt::max_memory == 0) {
+    opt::bits_per_kmer = -opt::nHash / std::log(1 - std::pow(opt::fpr, 1.0 / opt::nHash));
+  }
+
+  if (opt::minimizer > opt::k) {
+    std::cerr << "shark: the minimizer length cannot exceed k." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::engine != "ssbt" && (opt::bits_per_kmer > 0 || opt::max_memory > 0)) {
+    std::cerr << "shark: -z, -P and -M require the ssbt engine." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // The other engines would credit the whole run of a minimizer
+  if (opt::minimizer > 0 && opt::engine != "exact") {
+    std::cerr << "shark: -w requires the exact engine." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::engine != "ssbt" && opt::bf_type == "blocked") {
+    std::cerr << "shark: blocked bloom filters require the ssbt engine." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // The indexes to merge
+  for (int i = optind; i < argc; ++i)
+    opt::shard_paths.push_back(argv[i]);
+  if (opt::merge) {
+    if (opt::index_path == "" || opt::shard_paths.size() < 2 || opt::fasta_path != "") {
+      std::cerr << "shark : merge needs the output index (-i) and at least 2 indexes to merge" << std::endl;
+      std::cerr << "\n" << USAGE_MESSAGE;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  const bool update = opt::add_path != "" || opt::remove_path != "";
+  if (update && (!opt::build_index || opt::fasta_path != "")) {
+    std::cerr << "shark: -a and -d update an index with \"shark index -i\", without -r" << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::build_index) {
+    if ((opt::fasta_path == "" && !update) || opt::index_path == "") {
+      std::cerr << "shark : missing required files" << std::endl;
+      std::cerr << "\n" << USAGE_MESSAGE;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if ((opt::fasta_path == "" && opt::index_path == "") || opt::sample1_path == "") {
     std::cerr << "shark : missing required files" << std::endl;
     std::cerr << "\n" << USAGE_MESSAGE;
     exit(EXIT_FAILURE);
   }
 
+  if (opt::fasta_path != "" && opt::index_path != "") {
+    std::cerr << "shark : -r and -i cannot be used together" << std::endl;
+    std::cerr << "\n" << USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
   if(opt::out2_path == "" && opt::out1_path != "") {
     opt::out2_path = "sharked_sample.2";
   }
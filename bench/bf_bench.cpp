@@ -0,0 +1,101 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Micro-benchmark of the bloom filter node formats: false positive rate and
+ * probe throughput of simple and blocked filters, for several numbers of
+ * hash functions, on a single filter (by default larger than the L3 cache).
+ *
+ * Usage: bf_bench [log2 bits (default: 28)] [bits per k-mer (default: 10)]
+ *                 [queries (default: 10000000)]
+ **/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "bitvector.hpp"
+#include "kmer_utils.hpp"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  const uint64_t bits = (uint64_t)1 << (argc > 1 ? atoi(argv[1]) : 28);
+  const double bits_per_kmer = argc > 2 ? atof(argv[2]) : 10;
+  const size_t queries = argc > 3 ? atoll(argv[3]) : 10000000;
+  const size_t kmers = bits / bits_per_kmer;
+  const uint64_t mask = bits - 1;
+
+  printf("type\tnHash\tbits\tkmers\tfill\tfpr\tns_absent\tns_present\n");
+  for (const bool blocked : {false, true}) {
+    for (const int nHash : {1, 2, 3, 4, 6, 8}) {
+      BitSlab slab(bits / 64);
+      vector<size_t> hash(nHash);
+
+      // Inserted k-mers are even, queried absent k-mers are odd
+      mt19937_64 rng(42);
+      for (size_t i = 0; i < kmers; ++i) {
+        _get_hash(hash, rng() << 1, blocked);
+        for (const auto h : hash)
+          bv_set(slab.data(), h & mask);
+      }
+      size_t set = 0;
+      for (size_t w = 0; w < slab.words(); ++w)
+        set += __builtin_popcountll(slab.data()[w]);
+
+      vector<uint64_t> absent(queries * nHash), present(queries * nHash);
+      mt19937_64 qrng(7);
+      for (size_t q = 0; q < queries; ++q) {
+        _get_hash(hash, (qrng() << 1) | 1, blocked);
+        copy(hash.begin(), hash.end(), absent.begin() + q * nHash);
+      }
+      rng.seed(42);
+      for (size_t q = 0; q < queries && q < kmers; ++q) {
+        _get_hash(hash, rng() << 1, blocked);
+        copy(hash.begin(), hash.end(), present.begin() + q * nHash);
+      }
+      const size_t n_present = min(queries, kmers);
+
+      size_t positives = 0;
+      auto start = chrono::steady_clock::now();
+      for (size_t q = 0; q < queries; ++q)
+        positives += bv_probe(slab.data(), mask, &absent[q * nHash], nHash);
+      const double ns_absent =
+          chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / queries;
+
+      size_t found = 0;
+      start = chrono::steady_clock::now();
+      for (size_t q = 0; q < n_present; ++q)
+        found += bv_probe(slab.data(), mask, &present[q * nHash], nHash);
+      const double ns_present =
+          chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / n_present;
+      if (found != n_present)
+        fprintf(stderr, "bf_bench: false negatives (%zu/%zu)\n", found, n_present);
+
+      printf("%s\t%d\t%lu\t%zu\t%.3f\t%.5f\t%.1f\t%.1f\n",
+             blocked ? "blocked" : "simple", nHash, bits, kmers,
+             (double)set / bits, (double)positives / queries, ns_absent, ns_present);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,138 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Micro-benchmark of the hash families: time to compute the nHash hashes of
+ * a k-mer, and false positive rate of a filter filled with them, for several
+ * numbers of hash functions. The keys are the k-mers of random sequences,
+ * so consecutive keys share most of their bits as in a real sample.
+ *
+ * Usage: hash_bench [log2 bits (default: 24)] [bits per k-mer (default: 10)]
+ *                   [k (default: 31)]
+ **/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "bitvector.hpp"
+#include "kmer_utils.hpp"
+
+using namespace std;
+
+// The k-mers of a random sequence
+static vector<uint64_t> random_kmers(const size_t n, const uint k, const uint64_t seed) {
+  const uint64_t mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+  mt19937_64 rng(seed);
+  vector<uint64_t> kmers(n);
+  uint64_t kmer = rng();
+  for (size_t i = 0; i < n; ++i)
+    kmers[i] = kmer = ((kmer << 2) | (rng() & 3)) & mask;
+  return kmers;
+}
+
+template <typename H>
+static void bench(const vector<uint64_t> &present, const vector<uint64_t> &absent,
+                  const uint64_t bits) {
+  const uint64_t mask = bits - 1;
+  for (const int nHash : {1, 2, 3, 4, 6, 8}) {
+    vector<size_t> hash(nHash);
+    BitSlab slab(bits / 64);
+
+    // Best of 5 runs
+    size_t sum = 0;
+    double ns = 0;
+    for (int run = 0; run < 5; ++run) {
+      auto start = chrono::steady_clock::now();
+      for (const auto kmer : present) {
+        _get_hash<H>(hash, kmer);
+        for (const auto h : hash)
+          sum += h;
+      }
+      const double t =
+          chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / present.size();
+      ns = run == 0 ? t : min(ns, t);
+    }
+
+    for (const auto kmer : present) {
+      _get_hash<H>(hash, kmer);
+      for (const auto h : hash)
+        bv_set(slab.data(), h & mask);
+    }
+    size_t positives = 0;
+    for (const auto kmer : absent) {
+      _get_hash<H>(hash, kmer);
+      positives += bv_probe(slab.data(), mask, hash.data(), nHash);
+    }
+    printf("%s\t%d\t%.1f\t%.5f\t%zx\n", H::name(), nHash, ns,
+           (double)positives / absent.size(), sum & 0xf);
+  }
+}
+
+// Cost of nthash rolled along the sequence of the k-mers, as the reads are
+// read with HASH=nthash, instead of hashing every canonical k-mer (the
+// false positive rate is that of nthash)
+static void bench_rolled(const vector<uint64_t> &present, const uint k) {
+  for (const int nHash : {1, 2, 3, 4, 6, 8}) {
+    vector<size_t> hash(nHash);
+    size_t sum = 0;
+    double ns = 0;
+    for (int run = 0; run < 5; ++run) {
+      auto start = chrono::steady_clock::now();
+      NtHashRoller roller(k);
+      uint64_t kmer = present[0], rckmer = revcompl(kmer, k);
+      roller.reset(kmer, rckmer);
+      for (size_t i = 0; i < present.size(); ++i) {
+        if (i > 0) {
+          const uint64_t c = present[i] & 3;
+          roller.roll(c, kmer >> (2 * k - 2));
+          kmer = present[i];
+          rckmer = rsprepend(rckmer, reverse_char(c), k);
+        }
+        _get_rolled_hash(hash.data(), nHash, roller.hash(kmer, rckmer));
+        for (const auto h : hash)
+          sum += h;
+      }
+      const double t =
+          chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / present.size();
+      ns = run == 0 ? t : min(ns, t);
+    }
+    printf("%s\t%d\t%.1f\t-\t%zx\n", "nthash-rolled", nHash, ns, sum & 0xf);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const uint64_t bits = (uint64_t)1 << (argc > 1 ? atoi(argv[1]) : 24);
+  const double bits_per_kmer = argc > 2 ? atof(argv[2]) : 10;
+  const uint k = argc > 3 ? atoi(argv[3]) : 31;
+  const vector<uint64_t> present = random_kmers(bits / bits_per_kmer, k, 42);
+  const vector<uint64_t> absent = random_kmers(present.size(), k, 7);
+
+  printf("family\tnHash\tns_per_kmer\tfpr\tchecksum\n");
+  bench<XXHashFamily>(present, absent, bits);
+  bench<DoubleHashFamily>(present, absent, bits);
+  bench<MixHashFamily>(present, absent, bits);
+  bench<NtHashFamily>(present, absent, bits);
+  bench_rolled(present, k);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef BGZF_HPP
+#define BGZF_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+using namespace std;
+
+// Bytes per BGZF block, as in bgzip, so that a block always fits in 64 KB
+static const size_t BGZF_BLOCK = 0xff00;
+static const int BGZF_LEVEL = 6;
+
+// Empty block ending a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+    31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/**
+ * Appends to out the BGZF blocks of in: gzip members of at most BGZF_BLOCK
+ * bytes with their compressed size in the BC extra field, so that a file
+ * made of blocks compressed separately (and in parallel) is still a valid
+ * gzip file, and readers can inflate its blocks in parallel.
+ **/
+inline void bgzf_compress(const vector<char> &in, vector<char> &out) {
+#ifdef USE_LIBDEFLATE
+  static thread_local libdeflate_compressor *compressor = libdeflate_alloc_compressor(BGZF_LEVEL);
+#else
+  static thread_local z_stream stream = [] {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    deflateInit2(&stream, BGZF_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    return stream;
+  }();
+#endif
+  static const unsigned char header[18] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 0, 0};
+  const size_t max_size = 1 << 16;
+  for (size_t start = 0; start < in.size(); start += BGZF_BLOCK) {
+    const size_t length = min(BGZF_BLOCK, in.size() - start);
+    const unsigned char *const data = reinterpret_cast<const unsigned char *>(in.data() + start);
+    const size_t offset = out.size();
+    out.resize(offset + max_size);
+    unsigned char *const block = reinterpret_cast<unsigned char *>(out.data() + offset);
+    memcpy(block, header, sizeof(header));
+#ifdef USE_LIBDEFLATE
+    const size_t size = libdeflate_deflate_compress(compressor, data, length, block + 18, max_size - 26);
+#else
+    deflateReset(&stream);
+    stream.next_in = const_cast<unsigned char *>(data);
+    stream.avail_in = length;
+    stream.next_out = block + 18;
+    stream.avail_out = max_size - 26;
+    const size_t size = deflate(&stream, Z_FINISH) == Z_STREAM_END ? max_size - 26 - stream.avail_out : 0;
+#endif
+    if (size == 0) {
+      cerr << "shark: cannot compress the output" << endl << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    const size_t total = size + 26;
+    const uint32_t crc = crc32(0, data, length);
+    const uint32_t trailer[2] = {crc, (uint32_t)length};
+    block[16] = (total - 1) & 0xff;
+    block[17] = (total - 1) >> 8;
+    for (int i = 0; i < 8; ++i)
+      block[18 + size + i] = trailer[i >> 2] >> (8 * (i & 3));
+    out.resize(offset + total);
+  }
+}
+
+#endif
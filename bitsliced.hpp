@@ -0,0 +1,206 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef BITSLICED_HPP
+#define BITSLICED_HPP
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bitvector.hpp"
+#include "kmer_index.hpp"
+#include "kmer_utils.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+/**
+ * Bit-sliced signature index: one bloom filter of rows bits per gene,
+ * stored transposed. Row p holds bit p of every filter (one bit per gene,
+ * width words), so a k-mer is looked up by ANDing its nHash rows, which
+ * gives the set of genes containing it without walking a tree.
+ **/
+class BitSlicedIndex : public KmerIndex {
+public:
+  BitSlicedIndex(const size_t n_genes, const uint64_t rows, const bool blocked = false)
+      : _n_genes(n_genes), _rows(rows), _width((n_genes + 63) >> 6),
+        _slab(rows * _width), _locks(_width), _blocked(blocked),
+        _mapping(nullptr) {
+    _bits = _slab.data();
+  }
+
+  ~BitSlicedIndex() override { delete _mapping; }
+
+  void add(const size_t gene, const vector<size_t> &positions) override {
+    // Bit gene & 63 of word gene >> 6 of every row, shared by 64 genes
+    const word_t bit = (word_t)1 << (gene & 63);
+    word_t *const column = _bits + (gene >> 6);
+    lock_guard<mutex> guard(_locks[gene >> 6]);
+    for (const auto position : positions)
+      column[(position & (_rows - 1)) * _width] |= bit;
+  }
+
+  void get_genes(read_query_t &query) const override {
+    const size_t n = query.kmers.size();
+    const size_t nHash = query.nHash;
+    query.hits.clear();
+    hash_keys(query, _blocked);
+
+    start_scores(query, _n_genes);
+    vector<uint32_t> &found = query.active[0]; // genes with some k-mer
+    vector<uint32_t> &words = query.active[1];
+    found.clear();
+    query.colors.resize(_width);
+    word_t *const colors = query.colors.data();
+
+    // Genes without any of the k-mers from first on cannot reach min_score,
+    // from there on only the words of the genes already found are read
+    size_t first = 0;
+    unsigned int left = 0; // k-mers from first on
+    for (size_t i = 0; i < n; ++i)
+      left += query.runs[i];
+    while (first < n && (query.by_bases
+                             ? query.ends[n - 1] - (query.ends[first] - query.runs[first] + 1) + query.k
+                             : left) >= query.min_score)
+      left -= query.runs[first++];
+
+    query.probes += n;
+    for (size_t i = 0; i < first; ++i) {
+      const size_t *const hash = &query.hash[i * nHash];
+      if (i + 1 < first)
+        prefetch_rows(&query.hash[(i + 1) * nHash], nHash);
+      const word_t *row = _bits + (hash[0] & (_rows - 1)) * _width;
+      word_t any = 0;
+      for (size_t w = 0; w < _width; ++w)
+        any |= colors[w] = row[w];
+      for (size_t h = 1; h < nHash && any != 0; ++h) {
+        row = _bits + (hash[h] & (_rows - 1)) * _width;
+        any = 0;
+        for (size_t w = 0; w < _width; ++w)
+          any |= colors[w] &= row[w];
+      }
+      if (any != 0)
+        add_hits(query, i, colors, nullptr, _width);
+    }
+    if (first == n || found.empty())
+      return report(query);
+
+    // Candidate words and, in them, the candidate genes
+    words.clear();
+    fill(colors, colors + _width, 0);
+    for (const auto gene : found)
+      colors[gene >> 6] |= (word_t)1 << (gene & 63);
+    sort(found.begin(), found.end());
+    for (const auto gene : found)
+      if (words.empty() || words.back() != gene >> 6)
+        words.push_back(gene >> 6);
+    const size_t c = words.size();
+    query.colors.resize(_width + 2 * c);
+    word_t *const mask = query.colors.data() + _width;
+    word_t *const sub = mask + c;
+    for (size_t j = 0; j < c; ++j)
+      mask[j] = query.colors[words[j]];
+
+    for (size_t i = first; i < n; ++i) {
+      const size_t *const hash = &query.hash[i * nHash];
+      word_t any = 0;
+      for (size_t j = 0; j < c; ++j)
+        any |= sub[j] = mask[j];
+      for (size_t h = 0; h < nHash && any != 0; ++h) {
+        const word_t *const row = _bits + (hash[h] & (_rows - 1)) * _width;
+        any = 0;
+        for (size_t j = 0; j < c; ++j)
+          any |= sub[j] &= row[words[j]];
+      }
+      if (any != 0)
+        add_hits(query, i, sub, words.data(), c);
+    }
+    report(query);
+  }
+
+  void save(const string &path, const vector<string> &legend, const uint k,
+            const int nHash, const uint m) const override {
+    index_header_t header = make_header(
+        legend, k, nHash, m, INDEX_BITSLICED | (_blocked ? INDEX_BLOCKED : 0));
+    header.bits_offset = header.nodes_offset;
+    header.bits_words = _rows * _width;
+    write_index(path, header, legend, nullptr, 0, _bits);
+  }
+
+  // Builds the index on a mapping checked by map_index
+  static BitSlicedIndex *load(const string &path, MappedFile *mapping,
+                              const index_header_t &header) {
+    const size_t width = (header.n_genes + 63) >> 6;
+    const uint64_t rows = header.bits_words / width;
+    if (header.n_nodes != 0 || rows == 0 || (rows & (rows - 1)) != 0 ||
+        rows * width != header.bits_words)
+      fail_load(path, "corrupted bit-sliced index");
+    word_t *bits = reinterpret_cast<word_t *>(
+        const_cast<uint8_t *>(mapping->data() + header.bits_offset));
+    return new BitSlicedIndex(mapping, header.n_genes, rows, bits,
+                              header.flags & INDEX_BLOCKED);
+  }
+
+  size_t size() const override { return _rows; }
+  bool blocked() const override { return _blocked; }
+  string engine() const override { return "bitsliced"; }
+  size_t bytes() const override { return _rows * _width * sizeof(word_t); }
+
+  BitSlicedIndex(const BitSlicedIndex &) = delete;
+  const BitSlicedIndex &operator=(const BitSlicedIndex &) = delete;
+
+private:
+  // Scores the genes of k-mer i, colors[j] holds the genes of word
+  // words[j] (of word j if words is null)
+  void add_hits(read_query_t &query, const size_t i, const word_t *colors,
+                const uint32_t *words, const size_t n_words) const {
+    for (size_t j = 0; j < n_words; ++j)
+      for (word_t word = colors[j]; word != 0; word &= word - 1)
+        score(query, ((words == nullptr ? j : words[j]) << 6) + __builtin_ctzll(word), i);
+  }
+
+  void prefetch_rows(const size_t *const hash, const size_t nHash) const {
+    for (size_t h = 0; h < nHash; ++h) {
+      const word_t *const row = _bits + (hash[h] & (_rows - 1)) * _width;
+      for (size_t w = 0; w < _width; w += 8)
+        __builtin_prefetch(row + w);
+    }
+  }
+
+  BitSlicedIndex(MappedFile *mapping, const size_t n_genes, const uint64_t rows,
+                 word_t *bits, const bool blocked)
+      : _n_genes(n_genes), _rows(rows), _width((n_genes + 63) >> 6),
+        _slab(bits, rows * _width), _bits(bits), _blocked(blocked),
+        _mapping(mapping) {}
+
+  const size_t _n_genes;
+  const uint64_t _rows;
+  const size_t _width; // words per row
+  BitSlab _slab;
+  vector<mutex> _locks; // of the columns of 64 genes, while building
+  word_t *_bits;
+  const bool _blocked;
+  MappedFile *const _mapping;
+};
+
+#endif
@@ -0,0 +1,210 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef BITVECTOR_HPP
+#define BITVECTOR_HPP
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+typedef uint64_t word_t;
+
+/**
+ * Slab of 64-bit words holding a set of bit vectors. The slab either owns
+ * its memory (cache-line aligned, huge-page aligned when large) or wraps
+ * an external block, e.g. a memory-mapped index.
+ **/
+class BitSlab {
+public:
+  BitSlab() : _bits(nullptr), _words(0), _owned(false) {}
+
+  explicit BitSlab(const size_t words)
+      : _bits(allocate(words)), _words(words), _owned(true) {}
+
+  BitSlab(word_t *const bits, const size_t words)
+      : _bits(bits), _words(words), _owned(false) {}
+
+  ~BitSlab() {
+    if (_owned)
+      free(_bits);
+  }
+
+  BitSlab(BitSlab &&other)
+      : _bits(other._bits), _words(other._words), _owned(other._owned) {
+    other._bits = nullptr;
+    other._owned = false;
+  }
+
+  BitSlab &operator=(BitSlab &&other) {
+    swap(_bits, other._bits);
+    swap(_words, other._words);
+    swap(_owned, other._owned);
+    return *this;
+  }
+
+  BitSlab(const BitSlab &) = delete;
+  BitSlab &operator=(const BitSlab &) = delete;
+
+  word_t *data() { return _bits; }
+  const word_t *data() const { return _bits; }
+  size_t words() const { return _words; }
+
+private:
+  static word_t *allocate(const size_t words) {
+    const size_t huge_page = 1 << 21;
+    const size_t bytes = max(words, (size_t)1) * sizeof(word_t);
+    const size_t alignment = bytes >= huge_page ? huge_page : 64;
+    void *slab = nullptr;
+    if (posix_memalign(&slab, alignment, (bytes + alignment - 1) & ~(alignment - 1)) != 0) {
+      cerr << "shark: cannot allocate " << bytes << " bytes for the bloom filters" << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+#ifdef MADV_HUGEPAGE
+    if (alignment == huge_page)
+      madvise(slab, bytes, MADV_HUGEPAGE);
+#endif
+    memset(slab, 0, bytes);
+    return static_cast<word_t *>(slab);
+  }
+
+  word_t *_bits;
+  size_t _words;
+  bool _owned;
+};
+
+inline void bv_set(word_t *const bits, const uint64_t p) {
+  bits[p >> 6] |= (word_t)1 << (p & 63);
+}
+
+inline bool bv_test(const word_t *const bits, const uint64_t p) {
+  return (bits[p >> 6] >> (p & 63)) & 1;
+}
+
+// Fast range reduction (Lemire): maps h onto [0, n) with its high bits, for
+// bit vectors whose size is not a power of 2
+inline uint64_t bv_range(const uint64_t h, const uint64_t n) {
+  return (uint64_t)(((__uint128_t)h * n) >> 64);
+}
+
+/**
+ * ORs the bit vector src of src_words words into dst, of dst_words words,
+ * folding it: word i of src goes in word i % dst_words of dst. Both sizes
+ * must be powers of 2, with src_words >= dst_words, so that a position
+ * masked in src is the same position masked in dst.
+ **/
+inline void bv_or_fold(word_t *const dst, const size_t dst_words,
+                       const word_t *const src, const size_t src_words) {
+  for (size_t base = 0; base < src_words; base += dst_words) {
+    const word_t *const from = src + base;
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 4 <= dst_words; i += 4) {
+      __m256i *const to = reinterpret_cast<__m256i *>(dst + i);
+      _mm256_storeu_si256(to, _mm256_or_si256(
+          _mm256_loadu_si256(to),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(from + i))));
+    }
+#endif
+    for (; i < dst_words; ++i)
+      dst[i] |= from[i];
+  }
+}
+
+/**
+ * ORs src into every copy of it that tiles dst, the opposite of
+ * bv_or_fold (dst_words >= src_words): a position masked in src can be
+ * any of its copies masked in dst.
+ **/
+inline void bv_or_tile(word_t *const dst, const size_t dst_words,
+                       const word_t *const src, const size_t src_words) {
+  for (size_t base = 0; base < dst_words; base += src_words)
+    bv_or_fold(dst + base, src_words, src, src_words);
+}
+
+/**
+ * Probe kernels: test whether all the positions hash[0..n) (reduced with
+ * mask) are set in a bit vector.
+ **/
+inline bool bv_probe_scalar(const word_t *const bits, const uint64_t mask,
+                            const uint64_t *const hash, const size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    if (!bv_test(bits, hash[i] & mask))
+      return false;
+  return true;
+}
+
+#if defined(__AVX2__)
+// Gathers and tests 4 words at a time, stopping at the first group with a
+// missing bit. Tails are handled with a masked gather when AVX-512VL is
+// available.
+inline bool bv_probe_simd(const word_t *const bits, const uint64_t mask,
+                          const uint64_t *const hash, const size_t n) {
+  const __m256i vmask = _mm256_set1_epi64x(mask);
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i low = _mm256_set1_epi64x(63);
+  const long long *const base = reinterpret_cast<const long long *>(bits);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m256i p = _mm256_and_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hash + i)), vmask);
+    const __m256i w = _mm256_i64gather_epi64(base, _mm256_srli_epi64(p, 6), 8);
+    const __m256i b = _mm256_sllv_epi64(one, _mm256_and_si256(p, low));
+    if (!_mm256_testc_si256(w, b))
+      return false;
+  }
+  if (i == n)
+    return true;
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+  const __mmask8 m = (1u << (n - i)) - 1;
+  const __m256i p =
+      _mm256_and_si256(_mm256_maskz_loadu_epi64(m, hash + i), vmask);
+  const __m256i w = _mm256_mmask_i64gather_epi64(
+      _mm256_setzero_si256(), m, _mm256_srli_epi64(p, 6), base, 8);
+  const __m256i b = _mm256_sllv_epi64(one, _mm256_and_si256(p, low));
+  return _mm256_mask_cmpeq_epi64_mask(m, _mm256_and_si256(w, b), b) == m;
+#else
+  return bv_probe_scalar(bits, mask, hash + i, n - i);
+#endif
+}
+#endif
+
+// With few hash functions the scalar loop (which stops at the first miss)
+// is faster than a gather.
+inline bool bv_probe(const word_t *const bits, const uint64_t mask,
+                     const uint64_t *const hash, const size_t n) {
+#if defined(__AVX2__)
+  if (n >= 4)
+    return bv_probe_simd(bits, mask, hash, n);
+#endif
+  return bv_probe_scalar(bits, mask, hash, n);
+}
+
+#endif
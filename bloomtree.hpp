@@ -25,60 +25,693 @@
 #include "simpleBF.hpp"
 #include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstring>
 #include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <vector>
 
+#include "kmer_index.hpp"
 #include "kmer_utils.hpp"
+#include "mapped_file.hpp"
 
 using namespace std;
 
 class KmerBuilder;
 class BloomfilterFiller;
 
-class SSBT {
+/**
+ * Topology of a tree to build: node i < n_genes is the leaf of gene i and
+ * node n_genes + j is the parent of the pair merged at step j.
+ **/
+typedef vector<pair<uint32_t, uint32_t>> merges_t;
+
+class SSBT : public KmerIndex {
   friend class KmerBuilder;
   friend class BloomfilterFiller;
 
 public:
   typedef uint64_t kmer_t;
 
-  explicit SSBT(const SimpleBF *const root)
-      : _root(root), _size(root->size()) {}
+  /**
+   * With no sizes the filters double at every level, from leaf_size bits
+   * for the deepest leaves. Otherwise sizes[i] is the size of node i
+   * (numbered as in merges_t), rounded up to whole words (blocks if
+   * blocked), and the hashes are reduced with a fast range.
+   **/
+  SSBT(const size_t n_genes, const merges_t &merges, const uint64_t leaf_size,
+       const bool blocked = false,
+       const vector<uint64_t> &sizes = vector<uint64_t>())
+      : _blocked(blocked), _ranged(!sizes.empty()), _mapping(nullptr) {
+    layout(n_genes, merges, [&](const size_t node, const uint32_t depth,
+                                const uint32_t height) {
+      return _ranged ? node_size(sizes[node], blocked) : leaf_size << (height - depth);
+    });
+  }
+
+  /**
+   * Updated copy of a tree. The leaves of the removed genes are dropped and
+   * their siblings take the place of their parents. The new genes, with
+   * added_kmers[j] k-mers, get empty leaves paired with the shallowest
+   * leaves, under new nodes with the size of the leaf they replace (so that
+   * they start as its copy). The new leaves have the size of that leaf
+   * too, unless the nodes are sized by k-mers: then they get the bits per
+   * k-mer of the leaves, estimated from their fill ratio with nHash hash
+   * functions. The genes kept are renumbered in order, the new ones follow
+   * them and are filled with add() as usual.
+   *
+   * A child is a fold of its parent, so the ancestors of a removed leaf
+   * cannot be rebuilt from their children: they keep only the bits that
+   * some k-mer set in one of their children could have set. The bits left
+   * of the removed genes only cost some false positive descents.
+   **/
+  SSBT(const SSBT &tree, const vector<bool> &removed,
+       const vector<uint64_t> &added_kmers, const int nHash)
+      : _blocked(tree._blocked), _ranged(tree._ranged), _mapping(nullptr) {
+    const SimpleBF *const old = tree._nodes;
+    const size_t n_old = tree._n_nodes;
+    const size_t n_added = added_kmers.size();
+
+    // Genes below every node, genes kept and depth of the nodes once the
+    // removed leaves are dropped
+    vector<uint32_t> genes(n_old, 1), kept(n_old, 0);
+    for (size_t i = n_old; i-- > 0;) {
+      const SimpleBF &node = old[i];
+      if (node.is_leaf()) {
+        kept[i] = !removed[node.id];
+      } else {
+        genes[i] = genes[node.child] + genes[node.child + 1];
+        kept[i] = kept[node.child] + kept[node.child + 1];
+      }
+    }
+    if (kept[0] == 0) {
+      cerr << "shark: cannot remove every gene of the index" << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    vector<uint32_t> depth(n_old, 0);
+    for (size_t i = 0; i < n_old; ++i)
+      if (!old[i].is_leaf()) {
+        const bool merged = kept[old[i].child] > 0 && kept[old[i].child + 1] > 0;
+        depth[old[i].child] = depth[old[i].child + 1] = depth[i] + merged;
+      }
+
+    double bits_per_kmer = 0;
+    if (_ranged) {
+      double set = 0, bits = 0;
+      for (size_t i = 0; i < n_old; ++i)
+        if (old[i].is_leaf() && kept[i] > 0) {
+          set += tree.bits_set(i);
+          bits += old[i].size;
+        }
+      if (set > 0 && set < bits)
+        bits_per_kmer = -nHash / log(1 - set / bits);
+    }
+
+    // New genes go below the leaves whose subtree stays the shallowest
+    vector<size_t> group(n_old, 0);
+    vector<uint32_t> gene_id(removed.size());
+    size_t n_kept = 0;
+    for (size_t g = 0; g < removed.size(); ++g)
+      gene_id[g] = removed[g] ? -1 : n_kept++;
+    typedef pair<uint32_t, uint32_t> spot_t; // subtree depth, leaf
+    priority_queue<spot_t, vector<spot_t>, greater<spot_t>> spots;
+    for (size_t i = 0; i < n_old; ++i)
+      if (old[i].is_leaf() && kept[i] > 0)
+        spots.push({depth[i], i});
+    for (size_t j = 0; j < n_added; ++j) {
+      const spot_t spot = spots.top();
+      spots.pop();
+      const size_t leaves = ++group[spot.second] + 1;
+      spots.push({depth[spot.second] + 64 - __builtin_clzll(leaves), spot.second});
+    }
+
+    // Topology of the new tree, with the node whose bits every new node
+    // starts from (-1 if none) and its size
+    const size_t n_genes = n_kept + n_added;
+    merges_t merges;
+    vector<int64_t> source(n_genes, -1);
+    vector<uint64_t> sizes(n_genes, 0);
+    vector<bool> shrunk(n_genes, false);
+    size_t next_gene = n_kept;
+    const uint32_t NONE = -1;
+    auto merge = [&](const uint32_t a, const uint32_t b, const int64_t from,
+                     const uint64_t size, const bool tighten) {
+      merges.emplace_back(a, b);
+      source.push_back(from);
+      sizes.push_back(size);
+      shrunk.push_back(tighten);
+      return (uint32_t)(n_genes + merges.size() - 1);
+    };
+    function<uint32_t(size_t)> rebuild = [&](const size_t i) -> uint32_t {
+      const SimpleBF &node = old[i];
+      if (node.is_leaf()) {
+        if (removed[node.id])
+          return NONE;
+        const uint32_t gene = gene_id[node.id];
+        source[gene] = i;
+        sizes[gene] = node.size;
+        // The leaf and its new genes, paired as a FIFO queue
+        deque<pair<uint32_t, bool>> coda(1, {gene, true});
+        for (size_t j = 0; j < group[i]; ++j, ++next_gene) {
+          sizes[next_gene] =
+              bits_per_kmer > 0
+                  ? node_size(ceil(added_kmers[next_gene - n_kept] * bits_per_kmer), _blocked)
+                  : node.size;
+          coda.push_back({next_gene, false});
+        }
+        while (coda.size() > 1) {
+          const auto a = coda.front();
+          coda.pop_front();
+          const auto b = coda.front();
+          coda.pop_front();
+          const bool copy = a.second || b.second;
+          coda.push_back({merge(a.first, b.first, copy ? (int64_t)i : -1, node.size, false), copy});
+        }
+        return coda.front().first;
+      }
+      const uint32_t a = rebuild(node.child);
+      const uint32_t b = rebuild(node.child + 1);
+      if (a == NONE || b == NONE)
+        return a == NONE ? b : a;
+      return merge(a, b, i, node.size, kept[i] < genes[i]);
+    };
+    rebuild(0);
+
+    const vector<uint32_t> order =
+        layout(n_genes, merges, [&](const size_t node, const uint32_t, const uint32_t) {
+          return sizes[node];
+        });
+    for (size_t i = 0; i < _n_nodes; ++i)
+      if (source[order[i]] >= 0)
+        memcpy(_bits + _nodes[i].offset, tree._bits + old[source[order[i]]].offset,
+               _nodes[i].words() * sizeof(word_t));
+    // Children first
+    for (size_t i = _n_nodes; i-- > 0;)
+      if (shrunk[order[i]])
+        tighten(i);
+  }
+
+  /**
+   * Tree joining the trees of indexes built independently (shards), with
+   * the same bloom filters, under new internal nodes paired as a FIFO
+   * queue. The genes of a shard follow those of the shards before it.
+   *
+   * A new node is sized as when building: twice its larger child, or, with
+   * nodes sized by k-mers, the k-mers of its children (estimated from their
+   * fill ratio with nHash hash functions) times the bits per k-mer of the
+   * leaves. Its children are then folded into it: every bit of a child
+   * sets the bits its hashes can reach in the node, that is its copies
+   * tiling the node when the sizes are powers of 2.
+   **/
+  SSBT(const vector<const SSBT *> &trees, const int nHash)
+      : _blocked(trees[0]->_blocked), _ranged(trees[0]->_ranged),
+        _mapping(nullptr) {
+    size_t n_genes = 0;
+    for (const auto tree : trees) {
+      if (tree->_blocked != _blocked || tree->_ranged != _ranged) {
+        cerr << "shark: the indexes to merge have different bloom filters" << endl
+             << "aborting..." << endl;
+        exit(EXIT_FAILURE);
+      }
+      n_genes += (tree->_n_nodes + 1) / 2;
+    }
+
+    // Topology of the shards, numbered as in merges_t, with the shard and
+    // node each one is copied from (the new nodes have none), and the
+    // k-mers of the roots of the shards when sized by k-mers
+    merges_t merges;
+    vector<uint64_t> sizes(n_genes);
+    vector<double> kmers(n_genes, 0);
+    vector<pair<int32_t, uint32_t>> source(n_genes);
+    deque<uint32_t> coda;
+    size_t first = 0;
+    double set = 0, bits = 0;
+    for (size_t t = 0; t < trees.size(); ++t) {
+      const SSBT &tree = *trees[t];
+      vector<uint32_t> number(tree._n_nodes);
+      for (size_t i = tree._n_nodes; i-- > 0;) {
+        const SimpleBF &node = tree._nodes[i];
+        if (node.is_leaf()) {
+          number[i] = first + node.id;
+          sizes[number[i]] = node.size;
+          source[number[i]] = {t, i};
+          if (_ranged) {
+            set += tree.bits_set(i);
+            bits += node.size;
+          }
+        } else {
+          merges.emplace_back(number[node.child], number[node.child + 1]);
+          number[i] = n_genes + merges.size() - 1;
+          sizes.push_back(node.size);
+          kmers.push_back(0);
+          source.push_back({t, i});
+        }
+      }
+      if (_ranged) {
+        const double fill = (double)tree.bits_set(0) / tree._nodes[0].size;
+        kmers[number[0]] = fill < 1 ? -log(1 - fill) * tree._nodes[0].size / nHash : -1;
+      }
+      coda.push_back(number[0]);
+      first += (tree._n_nodes + 1) / 2;
+    }
+    const double bits_per_kmer = set > 0 && set < bits ? -nHash / log(1 - set / bits) : 0;
+    // A saturated root has at least the k-mers its bits are sized for
+    for (const auto root : coda)
+      if (kmers[root] < 0)
+        kmers[root] = bits_per_kmer > 0 ? sizes[root] / bits_per_kmer : 0;
+    while (coda.size() > 1) {
+      const auto a = coda.front();
+      coda.pop_front();
+      const auto b = coda.front();
+      coda.pop_front();
+      merges.emplace_back(a, b);
+      kmers.push_back(kmers[a] + kmers[b]);
+      sizes.push_back(!_ranged ? 2 * max(sizes[a], sizes[b])
+                      : bits_per_kmer > 0 ? node_size(ceil(kmers.back() * bits_per_kmer), _blocked)
+                                          : sizes[a] + sizes[b]);
+      source.push_back({-1, 0});
+      coda.push_back(n_genes + merges.size() - 1);
+    }
+
+    const vector<uint32_t> order =
+        layout(n_genes, merges, [&](const size_t node, const uint32_t, const uint32_t) {
+          return sizes[node];
+        });
+    for (size_t i = 0; i < _n_nodes; ++i) {
+      const auto &from = source[order[i]];
+      if (from.first >= 0) {
+        const SSBT &tree = *trees[from.first];
+        memcpy(_bits + _nodes[i].offset, tree._bits + tree._nodes[from.second].offset,
+               _nodes[i].words() * sizeof(word_t));
+      }
+    }
+    // Children first
+    for (size_t i = _n_nodes; i-- > 0;)
+      if (source[order[i]].first < 0) {
+        fold(i, _nodes[_nodes[i].child]);
+        fold(i, _nodes[_nodes[i].child + 1]);
+      }
+  }
+
+  ~SSBT() override { delete _mapping; }
 
-  ~SSBT() { delete _root; }
+  // Size of a node of at least bits bits, when sized by k-mers
+  static uint64_t node_size(const uint64_t bits, const bool blocked) {
+    const uint64_t unit = blocked ? BF_BLOCK_BITS : 64;
+    return max((bits + unit - 1) / unit, (uint64_t)1) * unit;
+  }
 
   void get_genes(const kmer_t &kmer, vector<int> &genes,
                  vector<size_t> &hash) const {
     genes.clear();
-    _get_hash(hash, kmer);
-    inner_get_genes(_root, _size - 1, hash, genes);
+    _get_hash(hash, kmer, _blocked);
+    inner_get_genes(0, hash, genes);
+  }
+
+  // Read-centric traversal: a subtree is visited only with the k-mers of the
+  // read found in its root, and only if they can still reach min_score.
+  void get_genes(read_query_t &query) const override {
+    const size_t n = query.kmers.size();
+    const size_t nHash = query.nHash;
+    query.hits.clear();
+    hash_keys(query, _blocked);
+
+    if (query.active.empty())
+      query.active.resize(1);
+    vector<uint32_t> &found = query.active[0];
+    found.clear();
+    query.probes += n;
+    for (size_t i = 0; i < n; ++i)
+      if (probe(_nodes[0], &query.hash[i * nHash], nHash))
+        found.push_back(i);
+    inner_get_genes(0, 0, query);
+  }
+
+  size_t size() const override { return _nodes[0].size; }
+  bool blocked() const override { return _blocked; }
+  string engine() const override { return "ssbt"; }
+  size_t bytes() const override {
+    return _n_nodes * sizeof(SimpleBF) + _words * sizeof(word_t);
+  }
+  size_t nodes() const { return _n_nodes; }
+
+  // Size and fill ratio (fraction of bits set) of the leaves and of the
+  // internal nodes
+  void print_stats(ostream &out) const override {
+    for (const bool leaves : {true, false}) {
+      vector<uint64_t> sizes;
+      vector<double> fill;
+      uint64_t bits = 0;
+      for (size_t i = 0; i < _n_nodes; ++i) {
+        const SimpleBF &node = _nodes[i];
+        if (node.is_leaf() != leaves)
+          continue;
+        sizes.push_back(node.size);
+        fill.push_back((double)bits_set(i) / node.size);
+        bits += node.size;
+      }
+      if (sizes.empty())
+        continue;
+      sort(sizes.begin(), sizes.end());
+      double mean = 0;
+      for (const auto f : fill)
+        mean += f / fill.size();
+      out << (leaves ? "Leaves: " : "Internal nodes: ") << sizes.size() << ", "
+          << (bits >> 23) << " MB, size " << sizes.front() / 1024.0 << "/"
+          << sizes[sizes.size() / 2] / 1024.0 << "/" << sizes.back() / 1024.0
+          << " Kbits (min/median/max), fill " << *min_element(fill.begin(), fill.end())
+          << "/" << mean << "/" << *max_element(fill.begin(), fill.end())
+          << " (min/mean/max)" << endl;
+    }
+  }
+
+  // Construction helpers
+  size_t leaf(const size_t gene) const { return _leaves[gene]; }
+  size_t parent(const size_t node) const { return _parents[node]; }
+  void add_at(const size_t node, const uint64_t p) {
+    const SimpleBF &bf = _nodes[node];
+    bv_set(_bits + bf.offset, position(bf, p));
+  }
+
+  // Bit of hash h in node: masked, or reduced with a fast range (keeping
+  // the bits inside a block if blocked) when the sizes are not powers of 2
+  uint64_t position(const SimpleBF &node, const uint64_t h) const {
+    if (!_ranged)
+      return h & (node.size - 1);
+    if (!_blocked)
+      return bv_range(h, node.size);
+    return bv_range(h & ~(BF_BLOCK_BITS - 1), node.size / BF_BLOCK_BITS) * BF_BLOCK_BITS +
+           (h & (BF_BLOCK_BITS - 1));
+  }
+
+  bool probe(const SimpleBF &node, const size_t *const hash, const size_t n) const {
+    const word_t *const bits = _bits + node.offset;
+    if (!_ranged)
+      return bv_probe(bits, node.size - 1, hash, n);
+    for (size_t i = 0; i < n; ++i)
+      if (!bv_test(bits, position(node, hash[i])))
+        return false;
+    return true;
+  }
+
+  // The k-mers of a gene go in its leaf and in all its ancestors. The leaf
+  // belongs to the gene, the ancestors are locked one at a time and the
+  // busy ones are retried after the others, so concurrent genes sharing
+  // the top of the tree keep working on the other levels. When all the
+  // ones left are busy, it blocks on one of them.
+  void add(const size_t gene, const vector<size_t> &positions) override {
+    vector<uint32_t> path;
+    for (size_t node = parent(leaf(gene)); ; node = parent(node)) {
+      path.push_back(node);
+      if (node == 0) break; // root
+    }
+    for (const auto position : positions)
+      add_at(leaf(gene), position);
+    if (leaf(gene) == 0) return; // single gene
+
+    while (!path.empty()) {
+      bool written = false;
+      for (size_t i = 0; i < path.size();) {
+        mutex &lock = _locks[path[i]];
+        if (!lock.try_lock()) {
+          ++i;
+          continue;
+        }
+        for (const auto position : positions)
+          add_at(path[i], position);
+        lock.unlock();
+        path[i] = path.back();
+        path.pop_back();
+        written = true;
+      }
+      // All the nodes left are busy: wait for one instead of spinning
+      if (!written) {
+        lock_guard<mutex> guard(_locks[path.back()]);
+        for (const auto position : positions)
+          add_at(path.back(), position);
+        path.pop_back();
+      }
+    }
+  }
+
+  void save(const string &path, const vector<string> &legend, const uint k,
+            const int nHash, const uint m) const override {
+    index_header_t header =
+        make_header(legend, k, nHash, m,
+                    (_blocked ? INDEX_BLOCKED : 0) | (_ranged ? INDEX_RANGED : 0));
+    header.n_nodes = _n_nodes;
+    header.bits_offset =
+        align(header.nodes_offset + _n_nodes * sizeof(SimpleBF));
+    header.bits_words = _words;
+    write_index(path, header, legend, _nodes, _n_nodes * sizeof(SimpleBF), _bits);
   }
 
-  size_t size() const { return _size; }
+  // Builds the tree on a mapping checked by map_index
+  static SSBT *load(const string &path, MappedFile *mapping,
+                    const index_header_t &header) {
+    const uint8_t *base = mapping->data();
+    if (header.n_nodes != 2 * header.n_genes - 1 ||
+        header.nodes_offset + header.n_nodes * sizeof(SimpleBF) > header.bits_offset)
+      fail_load(path, "truncated index");
+    const SimpleBF *nodes =
+        reinterpret_cast<const SimpleBF *>(base + header.nodes_offset);
+    const bool ranged = header.flags & INDEX_RANGED;
+    const uint64_t unit = header.flags & INDEX_BLOCKED ? BF_BLOCK_BITS : 64;
+    for (uint64_t i = 0; i < header.n_nodes; ++i) {
+      const SimpleBF &node = nodes[i];
+      if (node.offset + node.words() > header.bits_words || node.size == 0 ||
+          (ranged ? node.size % unit != 0 : (node.size & (node.size - 1)) != 0) ||
+          (node.is_leaf() && (node.id < 0 || (uint64_t)node.id >= header.n_genes)) ||
+          (!node.is_leaf() && (node.child <= i || node.child + 1 >= header.n_nodes)))
+        fail_load(path, "corrupted tree topology");
+    }
+    word_t *bits = reinterpret_cast<word_t *>(
+        const_cast<uint8_t *>(base + header.bits_offset));
+    return new SSBT(mapping, nodes, header.n_nodes, bits, header.bits_words,
+                    header.flags & INDEX_BLOCKED, ranged);
+  }
 
   SSBT() = delete;
   const SSBT &operator=(const SSBT &) = delete;
   const SSBT &operator=(const SSBT &&) = delete;
 
 private:
-  void inner_get_genes(const SimpleBF *const node, const size_t dynamic_mask,
-                       const vector<size_t> &hash, vector<int> &genes) const {
-    for (const auto index : hash) {
-      if (!node->_bf[index & dynamic_mask])
-        return;
+  SSBT(MappedFile *mapping, const SimpleBF *nodes, const size_t n_nodes,
+       word_t *bits, const size_t words, const bool blocked, const bool ranged)
+      : _nodes(nodes), _n_nodes(n_nodes), _bits(bits), _words(words),
+        _slab(bits, words), _blocked(blocked), _ranged(ranged),
+        _mapping(mapping) {}
+
+  // Lays out the nodes in BFS order, the children of a node are adjacent,
+  // and allocates the filters. size(node, depth, height) is the size of a
+  // node numbered as in merges_t. Returns the number of every node.
+  template <typename F>
+  vector<uint32_t> layout(const size_t n_genes, const merges_t &merges, F size) {
+    const size_t n_nodes = n_genes + merges.size();
+    const size_t root = n_nodes - 1;
+
+    vector<uint32_t> order(1, root);
+    vector<uint32_t> depth(1, 0);
+    _storage.resize(n_nodes);
+    _parents.assign(n_nodes, 0);
+    _locks = vector<mutex>(n_nodes);
+    _leaves.resize(n_genes);
+    for (size_t i = 0; i < order.size(); ++i) {
+      SimpleBF &node = _storage[i];
+      node.offset = 0;
+      if (order[i] < n_genes) {
+        node.child = 0;
+        node.id = order[i];
+        _leaves[order[i]] = i;
+      } else {
+        const auto &children = merges[order[i] - n_genes];
+        node.child = order.size();
+        node.id = -1;
+        order.push_back(children.first);
+        order.push_back(children.second);
+        depth.push_back(depth[i] + 1);
+        depth.push_back(depth[i] + 1);
+        _parents[node.child] = _parents[node.child + 1] = i;
+      }
+    }
+
+    // Each level starts on a cache line
+    const uint32_t height = depth.back();
+    _words = 0;
+    for (size_t i = 0; i < n_nodes; ++i) {
+      SimpleBF &node = _storage[i];
+      if (i > 0 && depth[i] != depth[i - 1])
+        _words = (_words + 7) & ~(size_t)7;
+      node.size = size(order[i], depth[i], height);
+      node.offset = _words;
+      _words += node.words();
+    }
+
+    _nodes = _storage.data();
+    _n_nodes = n_nodes;
+    _slab = BitSlab(_words);
+    _bits = _slab.data();
+    return order;
+  }
+
+  // Number of bits set in node i
+  uint64_t bits_set(const size_t i) const {
+    uint64_t set = 0;
+    for (size_t w = 0; w < _nodes[i].words(); ++w)
+      set += __builtin_popcountll(_bits[_nodes[i].offset + w]);
+    return set;
+  }
+
+  // Clears the bits of internal node i that no hash set in its children
+  // can have set
+  void tighten(const size_t i) {
+    const SimpleBF &node = _nodes[i];
+    word_t *const bits = _bits + node.offset;
+    if (!_ranged && node.size >= 64 && _nodes[node.child].size >= 64 &&
+        _nodes[node.child + 1].size >= 64) {
+      // Word p of the node is covered by the words p (mod size) of the children
+      for (size_t w = 0; w < node.words(); ++w)
+        bits[w] &= covered_word(_nodes[node.child], node, w) |
+                   covered_word(_nodes[node.child + 1], node, w);
+      return;
+    }
+    for (size_t w = 0; w < node.words(); ++w)
+      for (word_t word = bits[w]; word != 0; word &= word - 1) {
+        const uint64_t p = (w << 6) + __builtin_ctzll(word);
+        if (!covers(_nodes[node.child], node, p) && !covers(_nodes[node.child + 1], node, p))
+          bits[w] &= ~((word_t)1 << (p & 63));
+      }
+  }
+
+  // Bits of word w of parent that some hash set in child can have set,
+  // with sizes that are powers of 2 of at least one word
+  word_t covered_word(const SimpleBF &child, const SimpleBF &parent, const size_t w) const {
+    const word_t *const bits = _bits + child.offset;
+    word_t covered = 0;
+    for (size_t c = w & (child.words() - 1); c < child.words(); c += parent.words())
+      covered |= bits[c];
+    return covered;
+  }
+
+  // Some hash with bit p in parent has its bit set in child
+  bool covers(const SimpleBF &child, const SimpleBF &parent, const uint64_t p) const {
+    const word_t *const bits = _bits + child.offset;
+    if (!_ranged) {
+      for (uint64_t c = p & (child.size - 1); c < child.size; c += parent.size)
+        if (bv_test(bits, c))
+          return true;
+      return false;
     }
+    const uint64_t unit = _blocked ? BF_BLOCK_BITS : 1;
+    const auto units = ranged_units(parent, p / unit, child);
+    for (uint64_t c = units.first; c <= units.second; ++c)
+      if (bv_test(bits, c * unit + p % unit))
+        return true;
+    return false;
+  }
 
-    if (node->sx == nullptr) {
-      // This is a leaf
-      genes.push_back(node->_id);
+  // Sets in node i the bits that the hashes set in child can reach
+  void fold(const size_t i, const SimpleBF &child) {
+    const SimpleBF &node = _nodes[i];
+    word_t *const bits = _bits + node.offset;
+    const word_t *const from = _bits + child.offset;
+    if (!_ranged)
+      return child.words() >= node.words() ? bv_or_fold(bits, node.words(), from, child.words())
+                                           : bv_or_tile(bits, node.words(), from, child.words());
+    const uint64_t unit = _blocked ? BF_BLOCK_BITS : 1;
+    for (size_t w = 0; w < child.words(); ++w)
+      for (word_t word = from[w]; word != 0; word &= word - 1) {
+        const uint64_t p = (w << 6) + __builtin_ctzll(word);
+        const auto units = ranged_units(child, p / unit, node);
+        for (uint64_t c = units.first; c <= units.second; ++c)
+          bv_set(bits, c * unit + p % unit);
+      }
+  }
+
+  // Units (blocks if blocked, bits otherwise) of node to where the hashes
+  // reduced to unit u of node from go, with ranged nodes: the hashes of a
+  // unit are an interval, reduced to an interval
+  pair<uint64_t, uint64_t> ranged_units(const SimpleBF &from, const uint64_t u,
+                                        const SimpleBF &to) const {
+    const uint64_t unit = _blocked ? BF_BLOCK_BITS : 1;
+    const uint64_t units = from.size / unit;
+    const uint64_t first = (((__uint128_t)u << 64) + units - 1) / units;
+    const uint64_t last = (((__uint128_t)(u + 1) << 64) + units - 1) / units - 1;
+    return {bv_range(first, to.size / unit), bv_range(last, to.size / unit)};
+  }
+
+  void inner_get_genes(const size_t i, const vector<size_t> &hash,
+                       vector<int> &genes) const {
+    const SimpleBF &node = _nodes[i];
+    if (!probe(node, hash.data(), hash.size()))
+      return;
+
+    if (node.is_leaf()) {
+      genes.push_back(node.id);
     } else {
-      inner_get_genes(node->sx, dynamic_mask >> 1, hash, genes);
-      inner_get_genes(node->dx, dynamic_mask >> 1, hash, genes);
+      inner_get_genes(node.child, hash, genes);
+      inner_get_genes(node.child + 1, hash, genes);
+    }
+  }
+
+  // query.active[depth] holds the k-mers of the read found in node i
+  void inner_get_genes(const size_t i, const size_t depth,
+                       read_query_t &query) const {
+    const vector<uint32_t> &found = query.active[depth];
+    if (found.empty())
+      return;
+    unsigned int kmers = 0;
+    unsigned int bases = 0;
+    uint32_t last = 0;
+    for (const auto j : found) {
+      const uint32_t run = query.runs[j];
+      if (query.by_bases) {
+        bases += (kmers == 0 ? query.k : min(query.k, query.ends[j] - run + 1 - last)) + run - 1;
+        last = query.ends[j];
+      }
+      kmers += run;
+    }
+    if ((query.by_bases ? bases : kmers) < query.min_score)
+      return;
+
+    const SimpleBF &node = _nodes[i];
+    if (node.is_leaf()) {
+      query.hits.push_back({node.id, bases, kmers});
+      return;
+    }
+
+    if (query.active.size() == depth + 1)
+      query.active.resize(depth + 2);
+    for (size_t c = node.child; c <= node.child + 1; ++c) {
+      const SimpleBF &child = _nodes[c];
+      const vector<uint32_t> &parent = query.active[depth];
+      vector<uint32_t> &sub = query.active[depth + 1];
+      sub.clear();
+      query.probes += parent.size();
+      for (const auto j : parent)
+        if (probe(child, &query.hash[j * query.nHash], query.nHash))
+          sub.push_back(j);
+      inner_get_genes(c, depth + 1, query);
     }
   }
 
-  const SimpleBF *const _root;
-  const size_t _size;
+  const SimpleBF *_nodes;
+  size_t _n_nodes;
+  word_t *_bits;
+  size_t _words;
+  BitSlab _slab;
+  vector<SimpleBF> _storage;
+  vector<uint32_t> _parents;
+  vector<uint32_t> _leaves;
+  vector<mutex> _locks; // of the nodes, while building
+  const bool _blocked;
+  const bool _ranged; // node sizes are not powers of 2
+  MappedFile *const _mapping;
 };
 
 #endif
@@ -22,17 +22,135 @@
 #ifndef SHARK_COMMON_HPP
 #define SHARK_COMMON_HPP
 
+#include <cstddef>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 using std::string;
+using std::vector;
 
-struct sharseq_t {
-  string id, seq, qual;
+// Read-only view of characters stored elsewhere, with the interface of a
+// string used by the k-mer functions
+struct str_view_t {
+  const char *data;
+  size_t length;
+
+  size_t size() const { return length; }
+  char operator[](const size_t i) const { return data[i]; }
+};
+
+// NUL-terminated string in the arena of a batch
+struct span_t {
+  size_t offset;
+  size_t length;
+};
+
+/**
+ * Read (or pair of mates) of a batch. seq is the sequence to analyze: the
+ * mates joined by an N, with the bases under the minimum quality masked.
+ * The bases and qualities of the mates are kept only when the matched reads
+ * are written: in the arena, or where they are if the sample is mapped in
+ * memory.
+ **/
+struct read_t {
+  span_t seq;
+  span_t id[2];
+  span_t bases[2];
+  span_t qual[2];
+  str_view_t mapped_bases[2];
+  str_view_t mapped_qual[2];
+};
+
+// Records of a mate, in a sample mapped in memory, that start in
+// [begin, end)
+struct chunk_t {
+  const char *begin;
+  const char *end;
+};
+
+// Gene associated to read number read of a batch
+struct association_t {
+  size_t read;
+  const string *gene;
+};
+
+/**
+ * Batch of reads, with the strings of all the reads in a single arena, and
+ * their associations. Batches are recycled through a ReadBatchPool, so in
+ * the steady state the arena and the vectors are reused without
+ * allocating.
+ **/
+struct read_batch_t {
+  vector<char> arena;
+  vector<read_t> reads;
+  vector<association_t> associations;
+
+  // Formatted output: associations, first and second mates
+  vector<char> text[3];
+
+  // Records still to parse, when the sample is mapped in memory (see
+  // MappedFastqSplitter)
+  chunk_t chunks[2];
+  bool resync;
+
+  read_batch_t() : chunks(), resync(false) {}
+
+  void clear() {
+    arena.clear();
+    reads.clear();
+    associations.clear();
+    for (auto &t : text)
+      t.clear();
+    chunks[0] = chunks[1] = {nullptr, nullptr};
+    resync = false;
+  }
+
+  // Appends the first length characters of s, NUL-terminated
+  span_t append(const char *const s, const size_t length) {
+    const span_t span = {arena.size(), length};
+    arena.insert(arena.end(), s, s + length);
+    arena.push_back('\0');
+    return span;
+  }
+
+  const char *c_str(const span_t &span) const { return arena.data() + span.offset; }
+  char *data(const span_t &span) { return arena.data() + span.offset; }
+  str_view_t view(const span_t &span) const { return {c_str(span), span.length}; }
 };
 
-typedef std::pair<string, std::pair<sharseq_t, sharseq_t>> elem_t;
+// Free batches, filled by FastqSplitter and given back by ReadOutput
+class ReadBatchPool {
+public:
+  ReadBatchPool() {}
+
+  ~ReadBatchPool() {
+    for (const auto batch : _free)
+      delete batch;
+  }
+
+  read_batch_t *get() {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_free.empty())
+      return new read_batch_t();
+    read_batch_t *const batch = _free.back();
+    _free.pop_back();
+    return batch;
+  }
 
-typedef std::pair<string, std::pair<sharseq_t, sharseq_t>> assoc_t;
+  void put(read_batch_t *const batch) {
+    batch->clear();
+    std::lock_guard<std::mutex> guard(_lock);
+    _free.push_back(batch);
+  }
+
+  ReadBatchPool(const ReadBatchPool &) = delete;
+  const ReadBatchPool &operator=(const ReadBatchPool &) = delete;
+
+private:
+  std::mutex _lock;
+  vector<read_batch_t *> _free;
+};
 
 #endif
@@ -0,0 +1,367 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef EXACT_HPP
+#define EXACT_HPP
+
+#include <algorithm>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "kmer_index.hpp"
+#include "kmer_utils.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+// Slot of the k-mer table, kmer is EMPTY_KMER in free slots
+struct kmer_slot_t {
+  uint64_t kmer;
+  uint64_t color;
+};
+
+static_assert(sizeof(kmer_slot_t) == 16, "kmer_slot_t must be packed");
+
+/**
+ * Exact index: an open-addressing table (linear probing) from canonical
+ * k-mer to color, the sorted set of genes containing it. Every distinct
+ * gene set is stored once, so a k-mer costs a table probe and a color
+ * fetch, without false positives.
+ *
+ * Genes must be added in increasing order. A k-mer of gene g moves from
+ * color c to c + {g}; the new color is created once per (c, g), so colors
+ * never repeat. finish() drops the colors left without k-mers.
+ *
+ * With minimizers (m > 0) the genes are still added as k-mers, and finish()
+ * buckets them by minimizer: the table then maps a minimizer to its bucket
+ * of (k-mer, color) entries, sorted by k-mer. A super-k-mer of a read costs
+ * a single table probe, and each of its k-mers is searched in the bucket,
+ * so the scores stay exact.
+ *
+ * Serialized as words: slots, n_colors, n_refs, the slots, the n_colors + 1
+ * color offsets and the n_refs gene ids (uint32_t). With minimizers, the
+ * counts are followed by n_buckets and n_entries, and the slots by the
+ * n_buckets + 1 bucket offsets and the entries.
+ **/
+class ExactIndex : public KmerIndex {
+public:
+  static const uint64_t EMPTY_KMER = ~0ULL;
+
+  ExactIndex(const size_t n_genes, const uint k = 0, const uint m = 0)
+      : _n_genes(n_genes), _k(k), _m(m), _n_kmers(0),
+        _table(1024, {EMPTY_KMER, 0}), _offsets(1, 0), _mapping(nullptr) {
+    bind();
+  }
+
+  ~ExactIndex() override { delete _mapping; }
+
+  // keys are the canonical k-mers of the gene (hashed() is false)
+  void add(const size_t gene, const vector<size_t> &keys) override {
+    const uint64_t NO_COLOR = ~0ULL;
+    _next.clear();
+    for (const uint64_t kmer : keys) {
+      if ((_n_kmers + 1) * 4 > _table.size() * 3)
+        grow();
+      kmer_slot_t &slot = _table[find(kmer)];
+      uint64_t color = NO_COLOR;
+      if (slot.kmer == kmer) {
+        color = slot.color;
+        if (_refs[_offsets[color + 1] - 1] == gene) // already seen in gene
+          continue;
+      } else {
+        slot.kmer = kmer;
+        ++_n_kmers;
+      }
+      auto next = _next.find(color);
+      if (next == _next.end()) {
+        if (color != NO_COLOR)
+          _refs.insert(_refs.end(), _refs.begin() + _offsets[color],
+                       _refs.begin() + _offsets[color + 1]);
+        _refs.push_back(gene);
+        _offsets.push_back(_refs.size());
+        next = _next.emplace(color, _offsets.size() - 2).first;
+      }
+      slot.color = next->second;
+    }
+    bind();
+  }
+
+  // Renumbers the colors still used by some k-mer, and buckets the k-mers
+  // by minimizer if asked
+  void finish() override {
+    vector<uint64_t> id(_offsets.size() - 1, EMPTY_KMER);
+    vector<uint64_t> offsets(1, 0);
+    vector<uint32_t> refs;
+    for (auto &slot : _table) {
+      if (slot.kmer == EMPTY_KMER)
+        continue;
+      uint64_t &c = id[slot.color];
+      if (c == EMPTY_KMER) {
+        refs.insert(refs.end(), _refs.begin() + _offsets[slot.color],
+                    _refs.begin() + _offsets[slot.color + 1]);
+        offsets.push_back(refs.size());
+        c = offsets.size() - 2;
+      }
+      slot.color = c;
+    }
+    _offsets.swap(offsets);
+    _refs.swap(refs);
+    _next.clear();
+    if (_m > 0)
+      make_buckets();
+    bind();
+  }
+
+  void get_genes(read_query_t &query) const override {
+    if (_m > 0)
+      return get_genes_by_run(query);
+    const size_t n = query.kmers.size();
+    query.hits.clear();
+    start_scores(query, _n_genes);
+    query.active[0].clear();
+    query.probes += n;
+    for (size_t i = 0; i < n; ++i) {
+      if (i + 1 < n)
+        __builtin_prefetch(_slots + (mix64(query.kmers[i + 1]) & _mask));
+      const kmer_slot_t &slot = _slots[find(query.kmers[i])];
+      if (slot.kmer == EMPTY_KMER)
+        continue;
+      for (uint64_t r = _color_offsets[slot.color]; r < _color_offsets[slot.color + 1]; ++r)
+        score(query, _color_refs[r], i);
+    }
+    report(query);
+  }
+
+  void save(const string &path, const vector<string> &legend, const uint k,
+            const int nHash, const uint m) const override {
+    const uint64_t n_colors = _n_colors;
+    const uint64_t n_refs = _color_offsets[n_colors];
+    index_header_t header = make_header(legend, k, nHash, m, INDEX_EXACT);
+    header.bits_offset = header.nodes_offset;
+    header.bits_words = words(_mask + 1, n_colors, n_refs, _n_buckets, _n_entries, _m > 0);
+    vector<word_t> words;
+    words.reserve(header.bits_words);
+    words.push_back(_mask + 1);
+    words.push_back(n_colors);
+    words.push_back(n_refs);
+    if (_m > 0) {
+      words.push_back(_n_buckets);
+      words.push_back(_n_entries);
+    }
+    const word_t *slots = reinterpret_cast<const word_t *>(_slots);
+    words.insert(words.end(), slots, slots + (_mask + 1) * 2);
+    if (_m > 0) {
+      words.insert(words.end(), _bucket_offsets, _bucket_offsets + _n_buckets + 1);
+      const word_t *entries = reinterpret_cast<const word_t *>(_entries);
+      words.insert(words.end(), entries, entries + _n_entries * 2);
+    }
+    words.insert(words.end(), _color_offsets, _color_offsets + n_colors + 1);
+    words.resize(header.bits_words, 0);
+    memcpy(words.data() + header.bits_words - (n_refs + 1) / 2, _color_refs,
+           n_refs * sizeof(uint32_t));
+    write_index(path, header, legend, nullptr, 0, words.data());
+  }
+
+  // Builds the index on a mapping checked by map_index
+  static ExactIndex *load(const string &path, MappedFile *mapping,
+                          const index_header_t &header) {
+    const word_t *words = reinterpret_cast<const word_t *>(mapping->data() + header.bits_offset);
+    const bool bucketed = header.minimizer > 0;
+    const size_t counts = bucketed ? 5 : 3;
+    if (header.n_nodes != 0 || header.bits_words < counts)
+      fail_load(path, "corrupted exact index");
+    const uint64_t slots = words[0], n_colors = words[1], n_refs = words[2];
+    const uint64_t n_buckets = bucketed ? words[3] : 0, n_entries = bucketed ? words[4] : 0;
+    // Every section lies in the words of the index, which map_index found
+    // in the file: bounding the counts by them keeps the sum from
+    // overflowing
+    const uint64_t n = header.bits_words;
+    if (slots == 0 || (slots & (slots - 1)) != 0 || slots > n || n_colors > n || n_refs > n ||
+        n_buckets > n || n_entries > n ||
+        n != ExactIndex::words(slots, n_colors, n_refs, n_buckets, n_entries, bucketed))
+      fail_load(path, "corrupted exact index");
+    const uint64_t *bucket_offsets = words + counts + slots * 2;
+    const kmer_slot_t *entries =
+        reinterpret_cast<const kmer_slot_t *>(bucket_offsets + (bucketed ? n_buckets + 1 : 0));
+    const uint64_t *offsets = reinterpret_cast<const uint64_t *>(entries + n_entries);
+    const uint32_t *refs = reinterpret_cast<const uint32_t *>(offsets + n_colors + 1);
+    if (offsets[n_colors] != n_refs || (bucketed && bucket_offsets[n_buckets] != n_entries))
+      fail_load(path, "corrupted exact index");
+    ExactIndex *index = new ExactIndex(mapping, header.n_genes, header.k, header.minimizer,
+                                       reinterpret_cast<const kmer_slot_t *>(words + counts),
+                                       slots, offsets, n_colors, refs);
+    index->_bucket_offsets = bucket_offsets;
+    index->_n_buckets = n_buckets;
+    index->_entries = entries;
+    index->_n_entries = n_entries;
+    return index;
+  }
+
+  bool hashed() const override { return false; }
+  bool concurrent_add() const override { return false; }
+  bool checks_kmers() const override { return _m > 0; }
+  size_t size() const override { return 0; }
+  bool blocked() const override { return false; }
+  string engine() const override { return "exact"; }
+  size_t bytes() const override {
+    return (_mask + 1) * sizeof(kmer_slot_t) + (_n_colors + 1) * sizeof(uint64_t) +
+           _color_offsets[_n_colors] * sizeof(uint32_t) +
+           (_m > 0 ? (_n_buckets + 1) * sizeof(uint64_t) + _n_entries * sizeof(kmer_slot_t) : 0);
+  }
+
+  ExactIndex(const ExactIndex &) = delete;
+  const ExactIndex &operator=(const ExactIndex &) = delete;
+
+private:
+  ExactIndex(MappedFile *mapping, const size_t n_genes, const uint k, const uint m,
+             const kmer_slot_t *slots, const uint64_t n_slots, const uint64_t *offsets,
+             const uint64_t n_colors, const uint32_t *refs)
+      : _n_genes(n_genes), _k(k), _m(m), _n_kmers(0), _slots(slots), _mask(n_slots - 1),
+        _color_offsets(offsets), _n_colors(n_colors), _color_refs(refs),
+        _bucket_offsets(nullptr), _n_buckets(0), _entries(nullptr), _n_entries(0),
+        _mapping(mapping) {}
+
+  // Words of the serialized index
+  static uint64_t words(const uint64_t slots, const uint64_t n_colors, const uint64_t n_refs,
+                        const uint64_t n_buckets, const uint64_t n_entries, const bool bucketed) {
+    return (bucketed ? 5 + n_buckets + 1 + n_entries * 2 : 3) + slots * 2 + (n_colors + 1) +
+           (n_refs + 1) / 2;
+  }
+
+  // The keys of the query are minimizers, with the k-mers of their runs in
+  // query.run_kmers: a k-mer is scored only if it is in the bucket
+  void get_genes_by_run(read_query_t &query) const {
+    const size_t n = query.kmers.size();
+    query.hits.clear();
+    start_scores(query, _n_genes);
+    query.active[0].clear();
+    query.probes += n;
+    const uint64_t *kmer = query.run_kmers.data();
+    for (size_t i = 0; i < n; kmer += query.runs[i++]) {
+      if (i + 1 < n)
+        __builtin_prefetch(_slots + (mix64(query.kmers[i + 1]) & _mask));
+      const kmer_slot_t &slot = _slots[find(query.kmers[i])];
+      if (slot.kmer == EMPTY_KMER)
+        continue;
+      const kmer_slot_t *const first = _entries + _bucket_offsets[slot.color];
+      const kmer_slot_t *const last = _entries + _bucket_offsets[slot.color + 1];
+      const uint32_t run = query.runs[i];
+      for (uint32_t j = 0; j < run; ++j) {
+        const kmer_slot_t *const entry = lower_bound(
+            first, last, kmer[j], [](const kmer_slot_t &e, const uint64_t x) { return e.kmer < x; });
+        if (entry == last || entry->kmer != kmer[j])
+          continue;
+        for (uint64_t r = _color_offsets[entry->color]; r < _color_offsets[entry->color + 1]; ++r)
+          score(query, _color_refs[r], query.ends[i] - (run - 1 - j), 1);
+      }
+    }
+    report(query);
+  }
+
+  // Replaces the k-mer table by a table of minimizers and their buckets
+  void make_buckets() {
+    vector<tuple<uint64_t, uint64_t, uint64_t>> kmers; // minimizer, k-mer, color
+    kmers.reserve(_n_kmers);
+    for (const auto &slot : _table)
+      if (slot.kmer != EMPTY_KMER)
+        kmers.emplace_back(kmer_minimizer(slot.kmer, _k, _m), slot.kmer, slot.color);
+    sort(kmers.begin(), kmers.end());
+    _entries_v.clear();
+    _bucket_offsets_v.assign(1, 0);
+    vector<uint64_t> minimizers;
+    for (size_t i = 0; i < kmers.size(); ++i) {
+      if (i > 0 && get<0>(kmers[i]) != get<0>(kmers[i - 1])) {
+        minimizers.push_back(get<0>(kmers[i - 1]));
+        _bucket_offsets_v.push_back(_entries_v.size());
+      }
+      _entries_v.push_back({get<1>(kmers[i]), get<2>(kmers[i])});
+    }
+    if (!kmers.empty()) {
+      minimizers.push_back(get<0>(kmers.back()));
+      _bucket_offsets_v.push_back(_entries_v.size());
+    }
+    size_t slots = 1024;
+    while (minimizers.size() * 4 > slots * 3)
+      slots *= 2;
+    vector<kmer_slot_t>(slots, {EMPTY_KMER, 0}).swap(_table);
+    bind();
+    for (size_t b = 0; b < minimizers.size(); ++b)
+      _table[find(minimizers[b])] = {minimizers[b], b};
+  }
+
+  // Slot of kmer, or the empty slot where it would go
+  size_t find(const uint64_t kmer) const {
+    size_t i = mix64(kmer) & _mask;
+    while (_slots[i].kmer != kmer && _slots[i].kmer != EMPTY_KMER)
+      i = (i + 1) & _mask;
+    return i;
+  }
+
+  void grow() {
+    vector<kmer_slot_t> table(_table.size() * 2, {EMPTY_KMER, 0});
+    _table.swap(table);
+    bind();
+    for (const auto &slot : table)
+      if (slot.kmer != EMPTY_KMER)
+        _table[find(slot.kmer)] = slot;
+  }
+
+  // Points the query view to the tables being built
+  void bind() {
+    _slots = _table.data();
+    _mask = _table.size() - 1;
+    _color_offsets = _offsets.data();
+    _n_colors = _offsets.size() - 1;
+    _color_refs = _refs.data();
+    _bucket_offsets = _bucket_offsets_v.data();
+    _n_buckets = _bucket_offsets_v.empty() ? 0 : _bucket_offsets_v.size() - 1;
+    _entries = _entries_v.data();
+    _n_entries = _entries_v.size();
+  }
+
+  const size_t _n_genes;
+  const uint _k;
+  const uint _m; // minimizer length of the buckets, 0 for none
+  size_t _n_kmers;
+
+  // Query view, on the tables below or on a mapping
+  const kmer_slot_t *_slots;
+  uint64_t _mask;
+  const uint64_t *_color_offsets;
+  uint64_t _n_colors;
+  const uint32_t *_color_refs;
+  const uint64_t *_bucket_offsets;
+  uint64_t _n_buckets;
+  const kmer_slot_t *_entries;
+  uint64_t _n_entries;
+
+  vector<kmer_slot_t> _table;
+  vector<uint64_t> _offsets;
+  vector<uint32_t> _refs;
+  vector<uint64_t> _bucket_offsets_v;
+  vector<kmer_slot_t> _entries_v;
+  unordered_map<uint64_t, uint64_t> _next; // color transitions of the gene
+  MappedFile *const _mapping;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#!/bin/bash
+# Runs shark on the example and compares the filtered samples with the truth
+# files. Usage: example/check.sh [path to shark] (default: ./shark)
+
+shark=${1:-./shark}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+check() {
+  if "$@"; then
+    echo "OK   $name"
+  else
+    echo "FAIL $name"
+    status=1
+  fi
+}
+
+# Filters the example with the given arguments, the samples go in $tmp
+run() {
+  "$shark" -r "$dir/ENSG00000277117.fa" -1 "$dir/sample_1.fq" -2 "$dir/sample_2.fq" \
+           "$@" 2> "$tmp/err"
+}
+
+same_as_truth() {
+  cmp -s "$1" "$dir/sharked.sample_1.truth.fq" && cmp -s "$2" "$dir/sharked.sample_2.truth.fq"
+}
+
+# The truth is made of the reads sharing k-mers with the gene, without false
+# positives of the filters
+name="exact engine"
+run -e exact -o "$tmp/e1.fq" -p "$tmp/e2.fq" > "$tmp/e.ssv"
+check same_as_truth "$tmp/e1.fq" "$tmp/e2.fq"
+
+name="exact engine with minimizers (-w 15)"
+run -e exact -w 15 -o "$tmp/w1.fq" -p "$tmp/w2.fq" > "$tmp/w.ssv"
+check same_as_truth "$tmp/w1.fq" "$tmp/w2.fq"
+name="minimizers rejected without -e exact"
+check bash -c '! "$0" index -r "$1" -i "$2" -w 15 2> /dev/null' \
+      "$shark" "$dir/ENSG00000277117.fa" "$tmp/w.shk"
+
+name="memory budget (-M 1)"
+run -M 1 -o "$tmp/m1.fq" -p "$tmp/m2.fq" > "$tmp/m.ssv"
+check same_as_truth "$tmp/m1.fq" "$tmp/m2.fq"
+
+name="budget of 0 MB rejected (-M 0)"
+check bash -c '! "$0" index -r "$1" -i "$2" -M 0 2> /dev/null' \
+      "$shark" "$dir/ENSG00000277117.fa" "$tmp/zero.shk"
+
+name="BGZF output (-g)"
+run -M 1 -g -o "$tmp/g1.fq.gz" -p "$tmp/g2.fq.gz" > "$tmp/g.ssv.gz"
+check same_as_truth <(gzip -dc "$tmp/g1.fq.gz") <(gzip -dc "$tmp/g2.fq.gz")
+name="BGZF associations (-g)"
+check cmp -s <(gzip -dc "$tmp/g.ssv.gz") "$tmp/m.ssv"
+
+# The samples read from pipes, plain and gzipped, and from /dev/stdin
+name="samples from pipes"
+"$shark" -r "$dir/ENSG00000277117.fa" -M 1 -o "$tmp/p1.fq" -p "$tmp/p2.fq" \
+         -1 <(cat "$dir/sample_1.fq") -2 <(gzip -c "$dir/sample_2.fq") > "$tmp/p.ssv" 2> "$tmp/err"
+check same_as_truth "$tmp/p1.fq" "$tmp/p2.fq"
+name="gzipped sample from /dev/stdin"
+gzip -c "$dir/sample_1.fq" |
+  "$shark" -r "$dir/ENSG00000277117.fa" -M 1 -o "$tmp/s1.fq" -p "$tmp/s2.fq" \
+           -1 /dev/stdin -2 "$dir/sample_2.fq" > "$tmp/s.ssv" 2> "$tmp/err"
+check same_as_truth "$tmp/s1.fq" "$tmp/s2.fq"
+
+# Multi-line records are not mapped in memory but read by kseq
+name="multi-line FASTQ"
+for i in 1 2; do
+  awk 'NR % 2 == 0 { print substr($0, 1, 30); print substr($0, 31); next } 1' \
+      "$dir/sample_$i.fq" > "$tmp/ml_$i.fq"
+done
+"$shark" -r "$dir/ENSG00000277117.fa" -1 "$tmp/ml_1.fq" -2 "$tmp/ml_2.fq" -e exact \
+         -o "$tmp/l1.fq" -p "$tmp/l2.fq" > "$tmp/l.ssv" 2> "$tmp/err"
+check same_as_truth "$tmp/l1.fq" "$tmp/l2.fq"
+
+# The matched reads are written with their id, without the header comments
+name="header comments dropped"
+sed 's/^@ENST[^ ]*$/& 1:N:0:ACGT/' "$dir/sample_1.fq" > "$tmp/c_1.fq"
+"$shark" -r "$dir/ENSG00000277117.fa" -1 "$tmp/c_1.fq" -2 "$dir/sample_2.fq" -e exact \
+         -o "$tmp/c1.fq" -p "$tmp/c2.fq" > "$tmp/c.ssv" 2> "$tmp/err"
+check same_as_truth "$tmp/c1.fq" "$tmp/c2.fq"
+
+# A gene without k-mers (only Ns) keeps its place among the names
+name="gene without k-mers"
+{ echo ">gN"; printf 'N%.0s' {1..60}; echo; cat "$dir/ENSG00000277117.fa"; } > "$tmp/n.fa"
+"$shark" -r "$tmp/n.fa" -1 "$dir/sample_1.fq" -2 "$dir/sample_2.fq" -e exact \
+         -o "$tmp/n1.fq" -p "$tmp/n2.fq" > "$tmp/n.ssv" 2> "$tmp/err"
+check same_as_truth "$tmp/n1.fq" "$tmp/n2.fq"
+name="gene without k-mers (associations)"
+check cmp -s "$tmp/n.ssv" "$tmp/e.ssv"
+
+exit $status
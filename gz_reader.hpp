@@ -0,0 +1,348 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef GZ_READER_HPP
+#define GZ_READER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tbb/pipeline.h>
+#include <zlib.h>
+#ifdef USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+using namespace std;
+
+/**
+ * Input file (plain or gzipped) decompressed ahead of the reader by a
+ * background thread, which is what kseq reads through gz_reader_read.
+ *
+ * BGZF files (as written by bgzip) are made of independent gzip members of
+ * at most 64 KB, whose compressed size is in their header: the background
+ * thread runs a pipeline that reads groups of members in order, inflates
+ * them in parallel (with libdeflate if built with USE_LIBDEFLATE, zlib
+ * otherwise) and queues them in order. Other files are inflated as a
+ * single stream by the background thread alone, which still takes the
+ * decompression off the thread parsing the reads.
+ *
+ * The file is opened once and read sequentially, the bytes peeked to tell
+ * its format are kept and read again from memory, so pipes, FIFOs and
+ * /dev/stdin can be read as well.
+ **/
+class GzReader {
+public:
+  GzReader(const string &path, const int threads)
+      : _path(path), _file(nullptr), _peeked_pos(0), _chunk(nullptr), _pos(0), _done(false),
+        _stop(false), _max_ready(2 * threads + 2) {
+    _file = fopen(path.c_str(), "rb");
+    if (_file == nullptr)
+      fail("cannot open");
+    const bool bgzf = is_bgzf();
+    if (bgzf)
+      _thread = thread([this, threads] { inflate_blocks(threads); });
+    else
+      _thread = thread([this] { inflate_stream(); });
+  }
+
+  ~GzReader() {
+    {
+      lock_guard<mutex> guard(_lock);
+      _stop = true;
+    }
+    _changed.notify_all();
+    _thread.join();
+    fclose(_file);
+    delete _chunk;
+    for (const auto chunk : _ready)
+      delete chunk;
+    for (const auto chunk : _free)
+      delete chunk;
+  }
+
+  // Copies up to len bytes in buf, 0 at the end of the file
+  int read(void *const buf, const unsigned len) {
+    while (_chunk == nullptr || _pos == _chunk->size()) {
+      unique_lock<mutex> guard(_lock);
+      if (_chunk != nullptr)
+        _free.push_back(_chunk);
+      _chunk = nullptr;
+      _changed.notify_all();
+      _changed.wait(guard, [this] { return !_ready.empty() || _done; });
+      if (_ready.empty())
+        return 0;
+      _chunk = _ready.front();
+      _ready.pop_front();
+      _pos = 0;
+    }
+    const size_t n = min((size_t)len, _chunk->size() - _pos);
+    memcpy(buf, _chunk->data() + _pos, n);
+    _pos += n;
+    return n;
+  }
+
+  GzReader(const GzReader &) = delete;
+  const GzReader &operator=(const GzReader &) = delete;
+
+private:
+  // Size of the chunks of a single stream, and members per group of BGZF
+  static const size_t CHUNK = 1 << 20;
+  static const size_t MEMBERS = 64;
+
+  // Group of BGZF members and their inflated bytes
+  struct group_t {
+    vector<unsigned char> in;
+    vector<size_t> ends; // of the members in in
+    vector<char> *out;
+  };
+
+  void fail(const string &msg) const {
+    cerr << "shark: " << msg << " " << _path << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Reads up to len bytes, the peeked ones first, 0 at the end of the file
+  size_t fill(unsigned char *const buf, const size_t len) {
+    size_t n = min(len, _peeked.size() - _peeked_pos);
+    memcpy(buf, _peeked.data() + _peeked_pos, n);
+    _peeked_pos += n;
+    if (n < len)
+      n += fread(buf + n, 1, len - n, _file);
+    if (n < len && ferror(_file))
+      fail("cannot read");
+    return n;
+  }
+
+  // The first member has the BC extra field of BGZF. The header is peeked,
+  // not rewound, since the file may not be seekable.
+  bool is_bgzf() {
+    _peeked.resize(18);
+    _peeked.resize(fread(_peeked.data(), 1, _peeked.size(), _file));
+    const unsigned char *const header = _peeked.data();
+    return _peeked.size() == 18 && header[0] == 31 && header[1] == 139 &&
+           header[2] == 8 && (header[3] & 4) != 0 && header[10] == 6 &&
+           header[11] == 0 && header[12] == 'B' && header[13] == 'C' &&
+           header[14] == 2 && header[15] == 0;
+  }
+
+  // Waits for room in the queue and returns a chunk to fill, nullptr if
+  // the reader is being destroyed
+  vector<char> *get_chunk() {
+    unique_lock<mutex> guard(_lock);
+    _changed.wait(guard, [this] { return _ready.size() < _max_ready || _stop; });
+    if (_stop)
+      return nullptr;
+    if (_free.empty())
+      return new vector<char>();
+    vector<char> *const chunk = _free.back();
+    _free.pop_back();
+    return chunk;
+  }
+
+  void put_chunk(vector<char> *const chunk) {
+    {
+      lock_guard<mutex> guard(_lock);
+      _ready.push_back(chunk);
+    }
+    _changed.notify_all();
+  }
+
+  void finish() {
+    {
+      lock_guard<mutex> guard(_lock);
+      _done = true;
+    }
+    _changed.notify_all();
+  }
+
+  // Plain files are copied, gzipped ones inflated member after member
+  void inflate_stream() {
+    const bool gzipped = _peeked.size() >= 2 && _peeked[0] == 31 && _peeked[1] == 139;
+    vector<unsigned char> in(1 << 17);
+    z_stream stream = inflate_stream_init();
+    bool in_member = false;
+    for (vector<char> *chunk; (chunk = get_chunk()) != nullptr;) {
+      chunk->resize(CHUNK);
+      unsigned char *const out = reinterpret_cast<unsigned char *>(chunk->data());
+      size_t n = 0;
+      if (!gzipped) {
+        n = fill(out, CHUNK);
+      } else {
+        stream.next_out = out;
+        stream.avail_out = CHUNK;
+        while (stream.avail_out > 0) {
+          if (stream.avail_in == 0) {
+            stream.avail_in = fill(in.data(), in.size());
+            stream.next_in = in.data();
+            if (stream.avail_in == 0)
+              break;
+          }
+          const int ret = inflate(&stream, Z_NO_FLUSH);
+          in_member = ret == Z_OK;
+          if (ret == Z_STREAM_END)
+            inflateReset(&stream);
+          else if (ret != Z_OK)
+            fail("cannot decompress");
+        }
+        if (stream.avail_out > 0 && in_member)
+          fail("truncated gzip file");
+        n = CHUNK - stream.avail_out;
+      }
+      if (n == 0) {
+        delete chunk;
+        break;
+      }
+      chunk->resize(n);
+      put_chunk(chunk);
+    }
+    inflateEnd(&stream);
+    finish();
+  }
+
+  void inflate_blocks(const int threads) {
+    tbb::filter_t<void, group_t *> reader(
+        tbb::filter::serial_in_order, [&](tbb::flow_control &fc) -> group_t * {
+          group_t *group = new group_t();
+          while (group->ends.size() < MEMBERS && read_member(group->in))
+            group->ends.push_back(group->in.size());
+          group->out = group->ends.empty() ? nullptr : get_chunk();
+          if (group->out == nullptr) {
+            fc.stop();
+            delete group;
+            return nullptr;
+          }
+          return group;
+        });
+    tbb::filter_t<group_t *, group_t *> inflater(
+        tbb::filter::parallel, [&](group_t *group) {
+          inflate_members(*group);
+          return group;
+        });
+    tbb::filter_t<group_t *, void> writer(
+        tbb::filter::serial_in_order, [&](group_t *group) {
+          put_chunk(group->out);
+          delete group;
+        });
+    tbb::parallel_pipeline(2 * threads, reader & inflater & writer);
+    finish();
+  }
+
+  // Appends the next BGZF member to in, false at the end of the file
+  bool read_member(vector<unsigned char> &in) {
+    const size_t start = in.size();
+    in.resize(start + 18);
+    const size_t n = fill(in.data() + start, 18);
+    if (n == 0) {
+      in.resize(start);
+      return false;
+    }
+    const unsigned char *header = in.data() + start;
+    if (n < 18 || header[0] != 31 || header[1] != 139 || header[12] != 'B' || header[13] != 'C')
+      fail("corrupted BGZF file");
+    const size_t size = (header[16] | header[17] << 8) + 1;
+    in.resize(start + size);
+    if (size < 26 || fill(in.data() + start + 18, size - 18) != size - 18)
+      fail("truncated BGZF file");
+    return true;
+  }
+
+  // Inflates the members of a group, one after the other in out
+  void inflate_members(group_t &group) const {
+    vector<char> &out = *group.out;
+    size_t total = 0;
+    for (const auto end : group.ends)
+      total += isize(group, end);
+    out.resize(total);
+#ifdef USE_LIBDEFLATE
+    static thread_local libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+#else
+    static thread_local z_stream stream = inflate_stream_init();
+#endif
+    size_t pos = 0;
+    for (size_t i = 0, start = 0; i < group.ends.size(); start = group.ends[i++]) {
+      const size_t size = isize(group, group.ends[i]);
+#ifdef USE_LIBDEFLATE
+      size_t inflated = 0;
+      if (libdeflate_gzip_decompress(decompressor, group.in.data() + start,
+                                     group.ends[i] - start, out.data() + pos, size,
+                                     &inflated) != LIBDEFLATE_SUCCESS ||
+          inflated != size)
+        fail("cannot decompress");
+#else
+      inflateReset(&stream);
+      stream.next_in = const_cast<unsigned char *>(group.in.data() + start);
+      stream.avail_in = group.ends[i] - start;
+      stream.next_out = reinterpret_cast<unsigned char *>(out.data() + pos);
+      stream.avail_out = size;
+      if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0)
+        fail("cannot decompress");
+#endif
+      pos += size;
+    }
+  }
+
+  // Inflated size of the member ending at end
+  static size_t isize(const group_t &group, const size_t end) {
+    const unsigned char *const tail = group.in.data() + end - 4;
+    return tail[0] | tail[1] << 8 | tail[2] << 16 | (size_t)tail[3] << 24;
+  }
+
+  static z_stream inflate_stream_init() {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    inflateInit2(&stream, 16 + MAX_WBITS);
+    return stream;
+  }
+
+  const string _path;
+  FILE *_file;
+  vector<unsigned char> _peeked; // first bytes of the file
+  size_t _peeked_pos;            // of the next one to read
+  thread _thread;
+
+  // Chunks inflated, in order, and chunks to reuse
+  mutex _lock;
+  condition_variable _changed;
+  deque<vector<char> *> _ready;
+  vector<vector<char> *> _free;
+  vector<char> *_chunk; // being read
+  size_t _pos;
+  bool _done; // no more chunks will be queued
+  bool _stop; // the reader is being destroyed
+  const size_t _max_ready;
+};
+
+inline int gz_reader_read(GzReader *const reader, void *const buf, const unsigned len) {
+  return reader->read(buf, len);
+}
+
+#endif
@@ -0,0 +1,353 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef KMER_INDEX_HPP
+#define KMER_INDEX_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bitvector.hpp"
+#include "kmer_utils.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+/**
+ * On-disk index layout (all integers little endian, sections 64-byte aligned):
+ *   index_header_t
+ *   nHash hash seeds (uint64_t)
+ *   gene legend, NUL-terminated names
+ *   n_nodes SimpleBF, in BFS order (SSBT only)
+ *   slab of the filters, as 64-bit words
+ * Both the nodes and the filters are used in place from the mapping.
+ **/
+static const char INDEX_MAGIC[8] = {'S', 'H', 'A', 'R', 'K', 'I', 'D', 'X'};
+static const uint32_t INDEX_VERSION = 4;
+
+// index_header_t::flags
+static const uint32_t INDEX_BLOCKED = 1;    // blocked bloom filters
+static const uint32_t INDEX_BITSLICED = 2;  // bit-sliced engine, no tree
+static const uint32_t INDEX_EXACT = 4;      // exact engine, no tree
+static const uint32_t INDEX_RANGED = 8;     // nodes sized by k-mers, fast range
+static const uint32_t INDEX_FLAGS = INDEX_BLOCKED | INDEX_BITSLICED | INDEX_EXACT | INDEX_RANGED;
+
+struct index_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t k;
+  uint32_t nHash;
+  uint32_t flags;
+  uint32_t minimizer; // length of the minimizers, 0 if keyed on k-mers
+  uint32_t hash_family; // HashFamily::id
+  uint64_t n_genes;
+  uint64_t n_nodes;
+  uint64_t seeds_offset;
+  uint64_t legend_offset;
+  uint64_t legend_bytes;
+  uint64_t nodes_offset;
+  uint64_t bits_offset;
+  uint64_t bits_words;
+};
+
+// Score of a gene for a read: bases covered by the k-mers found in the gene
+// and number of such k-mers.
+struct gene_hit_t {
+  int gene;
+  unsigned int bases;
+  unsigned int kmers;
+};
+
+/**
+ * Query of all the k-mers of a read at once. The caller fills the
+ * parameters and the k-mers, the index fills hits with every gene that can
+ * still reach min_score (on bases if by_bases, on k-mers otherwise). The
+ * other members are scratch space, reused across reads.
+ **/
+struct read_query_t {
+  read_query_t() : probes(0) {}
+
+  uint k;
+  int nHash;
+  bool by_bases;
+  double min_score;
+
+  vector<uint64_t> kmers; // keys: canonical k-mers or minimizers of the read
+  vector<uint32_t> ends;  // position of the last base of each key
+  vector<uint32_t> runs;  // consecutive k-mers ending at ends sharing the key
+  vector<uint64_t> run_kmers; // the k-mers of the runs, if the index checks them
+
+  vector<gene_hit_t> hits;
+  uint64_t probes; // node probes, summed over the keys
+
+  vector<uint64_t> rolled;         // hashes of the keys rolled along the read, if any
+  vector<size_t> hash;             // nHash hashes per k-mer
+  vector<vector<uint32_t>> active; // k-mers found at each depth
+  vector<gene_hit_t> genes;        // running score of every gene
+  vector<uint32_t> last;           // end of the last k-mer found in a gene
+  vector<word_t> colors;           // genes containing the current k-mer
+};
+
+// Query statistics, shared by the analyzers
+struct query_stats_t {
+  query_stats_t() : kmers(0), probes(0) {}
+
+  atomic<uint64_t> kmers;
+  atomic<uint64_t> probes;
+};
+
+/**
+ * Interface of the query engines. The engines are filled with the hash
+ * positions of the keys of KmerBuilder (modulo size()), or with the keys
+ * themselves if not hashed(), one gene at a time, then finish() is called
+ * once before querying. Different genes can be added concurrently, and in
+ * any order, unless concurrent_add() is false.
+ **/
+class KmerIndex {
+public:
+  virtual ~KmerIndex() {}
+
+  // Adds the k-mers of a gene, given as the positions of their hashes
+  virtual void add(const size_t gene, const vector<size_t> &positions) = 0;
+  virtual void finish() {}
+  virtual void get_genes(read_query_t &query) const = 0;
+  virtual void save(const string &path, const vector<string> &legend,
+                    const uint k, const int nHash, const uint m) const = 0;
+
+  // Size of the largest filter, the hashes are taken modulo this value
+  virtual size_t size() const = 0;
+  virtual bool hashed() const { return true; }
+  virtual bool concurrent_add() const { return true; }
+  // Keyed on minimizers, but checks the k-mers of every run (run_kmers)
+  virtual bool checks_kmers() const { return false; }
+  virtual bool blocked() const = 0;
+  virtual string engine() const = 0;
+  virtual size_t bytes() const = 0; // memory used by the queries
+  virtual void print_stats(ostream &) const {} // filters, for verbose mode
+
+  static void fail_load(const string &path, const string &msg) {
+    cerr << "shark: " << msg << " (" << path << ")" << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+protected:
+  // Flat engines score every gene of every k-mer of the read: a gene found
+  // for the first time goes in query.active[0], the genes reaching
+  // min_score are moved to the hits by report. query.active[1] is left
+  // to the engine.
+  static void start_scores(read_query_t &query, const size_t n_genes) {
+    if (query.genes.size() != n_genes) {
+      query.genes.assign(n_genes, {0, 0, 0});
+      query.last.resize(n_genes);
+    }
+    if (query.active.size() < 2)
+      query.active.resize(2);
+  }
+
+  // gene contains the key i of the read
+  static void score(read_query_t &query, const uint32_t gene, const size_t i) {
+    score(query, gene, query.ends[i], query.runs[i]);
+  }
+
+  // gene contains the run of k-mers ending at end
+  static void score(read_query_t &query, const uint32_t gene, const uint32_t end,
+                    const uint32_t run) {
+    gene_hit_t &hit = query.genes[gene];
+    if (hit.kmers == 0) {
+      query.active[0].push_back(gene);
+      hit.bases = query.k + run - 1;
+    } else {
+      hit.bases += min(query.k, end - run + 1 - query.last[gene]) + run - 1;
+    }
+    hit.kmers += run;
+    query.last[gene] = end;
+  }
+
+  static void report(read_query_t &query) {
+    for (const auto gene : query.active[0]) {
+      gene_hit_t &hit = query.genes[gene];
+      if ((query.by_bases ? hit.bases : hit.kmers) >= query.min_score)
+        query.hits.push_back({(int)gene, hit.bases, hit.kmers});
+      hit.kmers = 0;
+    }
+  }
+
+  // Fills query.hash with the nHash hashes of every key, from their rolled
+  // hashes if the reader rolled them, with the loop unrolled for up to 4
+  // hash functions
+  static void hash_keys(read_query_t &query, const bool blocked) {
+    switch (query.nHash) {
+    case 1: return hash_keys<1>(query, blocked);
+    case 2: return hash_keys<2>(query, blocked);
+    case 3: return hash_keys<3>(query, blocked);
+    case 4: return hash_keys<4>(query, blocked);
+    default: return hash_keys<0>(query, blocked);
+    }
+  }
+
+  template <int N> static void hash_keys(read_query_t &query, const bool blocked) {
+    const size_t nHash = N > 0 ? N : query.nHash;
+    const size_t n = query.kmers.size();
+    query.hash.resize(n * nHash);
+    if (query.rolled.size() == n) {
+      for (size_t i = 0; i < n; ++i)
+        _get_rolled_hash(&query.hash[i * nHash], nHash, query.rolled[i], blocked);
+      return;
+    }
+    for (size_t i = 0; i < n; ++i)
+      _get_hash(&query.hash[i * nHash], nHash, query.kmers[i], blocked);
+  }
+
+  static uint64_t align(const uint64_t offset) { return (offset + 63) & ~63ULL; }
+
+  // Header with the offsets of everything up to the nodes
+  static index_header_t make_header(const vector<string> &legend, const uint k,
+                                    const int nHash, const uint m,
+                                    const uint32_t flags) {
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.k = k;
+    header.nHash = nHash;
+    header.flags = flags;
+    header.minimizer = m;
+    header.hash_family = HashFamily::id;
+    header.n_genes = legend.size();
+    header.seeds_offset = align(sizeof(header));
+    header.legend_offset = align(header.seeds_offset + nHash * sizeof(uint64_t));
+    for (const auto &name : legend)
+      header.legend_bytes += name.size() + 1;
+    header.nodes_offset = align(header.legend_offset + header.legend_bytes);
+    return header;
+  }
+
+  static void write_index(const string &path, const index_header_t &header,
+                          const vector<string> &legend, const void *nodes,
+                          const size_t node_bytes, const word_t *bits) {
+    ofstream out(path, ios::binary);
+    if (!out) {
+      cerr << "shark: cannot write index " << path << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_at(out, header.seeds_offset, nullptr, 0);
+    for (uint32_t i = 0; i < header.nHash; ++i) {
+      const uint64_t seed = hash_seed(i);
+      out.write(reinterpret_cast<const char *>(&seed), sizeof(seed));
+    }
+    write_at(out, header.legend_offset, nullptr, 0);
+    for (const auto &name : legend)
+      out.write(name.c_str(), name.size() + 1);
+    write_at(out, header.nodes_offset, nodes, node_bytes);
+    write_at(out, header.bits_offset, bits, header.bits_words * sizeof(word_t));
+    if (!out) {
+      cerr << "shark: error while writing index " << path << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+private:
+  static void write_at(ofstream &out, const uint64_t offset, const void *data,
+                       const size_t bytes) {
+    static const char zeros[64] = {0};
+    const uint64_t pos = out.tellp();
+    if (pos < offset)
+      out.write(zeros, offset - pos);
+    if (bytes > 0)
+      out.write(reinterpret_cast<const char *>(data), bytes);
+  }
+};
+
+// Whether count items of width bytes from offset lie in a mapping of size
+// bytes, without overflowing
+inline bool in_mapping(const uint64_t offset, const uint64_t count,
+                       const uint64_t width, const uint64_t size) {
+  return offset <= size && count <= (size - offset) / width;
+}
+
+/**
+ * Maps an index and checks the parts shared by the engines. Returns the
+ * header, the legend and the k-mer parameters; the mapping is owned by
+ * the engine built on it.
+ **/
+inline const index_header_t &map_index(const string &path, MappedFile *&mapping,
+                                       vector<string> &legend, uint &k,
+                                       int &nHash, uint &m) {
+  mapping = new MappedFile(path);
+  if (!mapping->is_open() || mapping->size() < sizeof(index_header_t))
+    KmerIndex::fail_load(path, "cannot open index");
+  const uint8_t *base = mapping->data();
+  const index_header_t &header =
+      *reinterpret_cast<const index_header_t *>(base);
+  if (memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+    KmerIndex::fail_load(path, "not a shark index");
+  if (header.version != INDEX_VERSION)
+    KmerIndex::fail_load(path, "unsupported index version " + to_string(header.version));
+  if ((header.flags & ~INDEX_FLAGS) != 0)
+    KmerIndex::fail_load(path, "unsupported index flags");
+  if (header.k == 0 || header.k > 31 || header.minimizer > header.k)
+    KmerIndex::fail_load(path, "corrupted index header");
+  if (header.nHash == 0 || header.n_genes == 0 || header.n_genes > header.legend_bytes)
+    KmerIndex::fail_load(path, "corrupted index header");
+  const size_t size = mapping->size();
+  if (!in_mapping(header.seeds_offset, header.nHash, sizeof(uint64_t), size) ||
+      !in_mapping(header.legend_offset, header.legend_bytes, 1, size) ||
+      !in_mapping(header.bits_offset, header.bits_words, sizeof(word_t), size))
+    KmerIndex::fail_load(path, "truncated index");
+
+  if (header.hash_family != HashFamily::id)
+    KmerIndex::fail_load(path, "index built with hash family " + to_string(header.hash_family) +
+                                   ", not " + HashFamily::name());
+  const uint64_t *seeds =
+      reinterpret_cast<const uint64_t *>(base + header.seeds_offset);
+  for (size_t i = 0; i < header.nHash; ++i)
+    if (seeds[i] != hash_seed(i))
+      KmerIndex::fail_load(path, "index built with incompatible hash functions");
+  k = header.k;
+  nHash = header.nHash;
+  m = header.minimizer;
+
+  legend.clear();
+  legend.reserve(header.n_genes);
+  const char *name = reinterpret_cast<const char *>(base + header.legend_offset);
+  const char *const end = name + header.legend_bytes;
+  for (uint64_t i = 0; i < header.n_genes; ++i) {
+    const char *const nul = static_cast<const char *>(memchr(name, '\0', end - name));
+    if (nul == nullptr)
+      KmerIndex::fail_load(path, "corrupted gene names");
+    legend.emplace_back(name, nul - name);
+    name = nul + 1;
+  }
+  return header;
+}
+
+#endif
@@ -23,6 +23,8 @@
 #define _KMER_UTILS_HPP
 
 #include "xxhash.hpp"
+#include <string>
+#include <vector>
 
 using namespace std;
 
@@ -54,7 +56,9 @@ uint64_t revcompl(uint64_t kmer, const uint8_t k) {
   return rckmer;
 }
 
-int64_t build_kmer(const string &seq, int &p, const uint8_t k) {
+// S is a string or a str_view_t
+template <typename S>
+int64_t build_kmer(const S &seq, int &p, const uint8_t k) {
   for(int _p = p; _p < (int)seq.size() && _p < p+k; ++_p) {
     if(to_int[seq[_p]] == 0) p = _p + 1;
   }
@@ -78,9 +82,297 @@ inline uint64_t rsprepend(const uint64_t kmer, const uint64_t c, const uint64_t
   return (kmer >> 2) | (c << (2*k - 2));
 }
 
-inline void _get_hash(vector<size_t> &v, const uint64_t& kmer) {
-  for (size_t i= 0; i < v.size(); i++)
-	  v[i] = xxh::xxhash<64>(&kmer, sizeof(uint64_t), i * 100);
+// Calls f(canonical k-mer, position of its last base) on every k-mer of seq
+// made only of A, C, G and T, from left to right.
+template <typename S, typename F>
+inline void for_each_kmer(const S &seq, const uint8_t k, F f) {
+  int pos = 0;
+  uint64_t kmer = build_kmer(seq, pos, k);
+  if (kmer == (uint64_t)-1)
+    return;
+  uint64_t rckmer = revcompl(kmer, k);
+  f(min(kmer, rckmer), pos - 1);
+  for (; pos < (int)seq.size(); ++pos) {
+    uint8_t new_char = to_int[seq[pos]];
+    if (new_char == 0) { // Found a char different from A, C, G, T
+      ++pos; // we skip this character then we build a new kmer
+      kmer = build_kmer(seq, pos, k);
+      if (kmer == (uint64_t)-1)
+        break;
+      rckmer = revcompl(kmer, k);
+      --pos; // p must point to the ending position of the kmer, it will
+             // be incremented by the for
+    } else {
+      --new_char; // A is 1 but it should be 0
+      kmer = lsappend(kmer, new_char, k);
+      rckmer = rsprepend(rckmer, reverse_char(new_char), k);
+    }
+    f(min(kmer, rckmer), pos);
+  }
+}
+
+// 64-bit finalizer of MurmurHash3, k-mers are not random enough
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+/**
+ * Splits seq in super-k-mers: maximal runs of consecutive k-mers (made only
+ * of A, C, G and T) with the same minimizer, the canonical m-mer of the
+ * k-mer with the smallest mix64. Calls f(minimizer, position of the last
+ * base of the last k-mer, number of k-mers) on every run, from left to
+ * right. The minimizer of a k-mer and of its reverse complement is the
+ * same, so the keys do not depend on the strand.
+ **/
+template <typename S, typename F>
+inline void for_each_super_kmer(const S &seq, const uint8_t k,
+                                const uint8_t m, F f) {
+  const int w = k - m + 1; // m-mers per k-mer
+  vector<uint64_t> mmers(w), hashes(w);
+  const uint64_t mask = (m == 32 ? ~0ULL : (1ULL << 2 * m) - 1);
+  uint64_t fw = 0, rc = 0, key = 0;
+  int valid = 0, min_pos = -1, run = 0, run_end = 0;
+  for (int pos = 0; pos < (int)seq.size(); ++pos) {
+    uint8_t c = to_int[seq[pos]];
+    if (c == 0) { // Found a char different from A, C, G, T
+      if (run > 0)
+        f(key, run_end, run);
+      valid = run = 0;
+      min_pos = -1;
+      continue;
+    }
+    --c; // A is 1 but it should be 0
+    fw = ((fw << 2) | c) & mask;
+    rc = (rc >> 2) | ((uint64_t)reverse_char(c) << (2 * m - 2));
+    if (++valid < m)
+      continue;
+
+    // m-mer ending at pos, kept in a ring of the last w m-mers
+    const int slot = pos % w;
+    mmers[slot] = min(fw, rc);
+    hashes[slot] = mix64(mmers[slot]);
+    if (min_pos >= 0 && min_pos <= pos - w) {
+      min_pos = -1; // the minimizer left the window
+      for (int p = max(pos - w + 1, pos - valid + m); p <= pos; ++p)
+        if (min_pos < 0 || hashes[p % w] < hashes[min_pos % w])
+          min_pos = p;
+    } else if (min_pos < 0 || hashes[slot] < hashes[min_pos % w]) {
+      min_pos = pos;
+    }
+    if (valid < k)
+      continue;
+
+    const uint64_t minimizer = mmers[min_pos % w];
+    if (run > 0 && minimizer == key) {
+      ++run;
+    } else {
+      if (run > 0)
+        f(key, run_end, run);
+      key = minimizer;
+      run = 1;
+    }
+    run_end = pos;
+  }
+  if (run > 0)
+    f(key, run_end, run);
+}
+
+// Minimizer of a canonical k-mer, the key for_each_super_kmer gives to the
+// run containing it
+inline uint64_t kmer_minimizer(const uint64_t kmer, const uint8_t k, const uint8_t m) {
+  const uint64_t mask = (1ULL << 2 * m) - 1;
+  uint64_t minimizer = 0, min_hash = 0;
+  for (int i = 0; i + m <= k; ++i) {
+    const uint64_t fw = (kmer >> 2 * (k - m - i)) & mask;
+    const uint64_t mmer = min(fw, revcompl(fw, m));
+    const uint64_t hash = mix64(mmer);
+    if (i == 0 || hash < min_hash) {
+      minimizer = mmer;
+      min_hash = hash;
+    }
+  }
+  return minimizer;
+}
+
+inline uint64_t hash_seed(const size_t i) { return i * 100; }
+
+// Blocked bloom filters: the first hash selects a block of BF_BLOCK_BITS
+// bits (a cache line), the others only select a bit inside that block.
+static const uint64_t BF_BLOCK_BITS = 512;
+
+/**
+ * Hash families: hash(v, n, kmer) fills v with the n hashes of a key. The
+ * family is chosen at compile time (make HASH=xxhash|double|mix|nthash)
+ * and its id is stored in the index. A rolling family can also be updated
+ * base by base along a sequence (see NtHashRoller).
+ **/
+
+// One xxhash per hash function, seeded with hash_seed(i)
+struct XXHashFamily {
+  static const uint32_t id = 0;
+  static const bool rolling = false;
+  static const char *name() { return "xxhash"; }
+  static void hash(size_t *const v, const size_t n, const uint64_t kmer) {
+    for (size_t i = 0; i < n; i++)
+      v[i] = xxh::xxhash<64>(&kmer, sizeof(uint64_t), hash_seed(i));
+  }
+};
+
+// Kirsch-Mitzenmacher double hashing: h1 + i * h2, with h1 the xxhash of
+// the key and h2 (odd) its mix64, so one xxhash for any number of hashes
+struct DoubleHashFamily {
+  static const uint32_t id = 1;
+  static const bool rolling = false;
+  static const char *name() { return "double"; }
+  static void hash(size_t *const v, const size_t n, const uint64_t kmer) {
+    const uint64_t h1 = xxh::xxhash<64>(&kmer, sizeof(uint64_t), hash_seed(0));
+    const uint64_t h2 = mix64(h1) | 1;
+    for (size_t i = 0; i < n; i++)
+      v[i] = h1 + i * h2;
+  }
+};
+
+// Multiply-shift mixer: the two halves of a 128-bit product, xored
+struct MixHashFamily {
+  static const uint32_t id = 2;
+  static const bool rolling = false;
+  static const char *name() { return "mix"; }
+  static void hash(size_t *const v, const size_t n, const uint64_t kmer) {
+    for (size_t i = 0; i < n; i++) {
+      const __uint128_t p = (__uint128_t)(kmer ^ (0x9e3779b97f4a7c15ULL * (hash_seed(i) + 1))) *
+                            0xd6e8feb86659fd93ULL;
+      v[i] = (uint64_t)p ^ (uint64_t)(p >> 64);
+    }
+  }
+};
+
+inline uint64_t rol(const uint64_t x, const unsigned r) {
+  return r % 64 == 0 ? x : (x << (r % 64)) | (x >> (64 - r % 64));
+}
+
+/**
+ * ntHash: the hash of a key is the xor of the seeds of its bases, the seed
+ * of the base j positions from the end rotated left by j, so that it rolls
+ * along a sequence with a rotation and two xors (NtHashRoller). The key is
+ * hashed as 32 bases, the ones above the k-mer being A, which only xors a
+ * constant (for a given k) into the ntHash of the k-mer. That xor is
+ * linear in the bases, which raises the false positive rate of the bloom
+ * filters on real sequences, so the n hashes are the mix64 of n different
+ * offsets of it.
+ **/
+struct NtHashFamily {
+  static const uint32_t id = 3;
+  static const bool rolling = true;
+  static const char *name() { return "nthash"; }
+  static uint64_t seed(const uint64_t base) {
+    static const uint64_t seeds[4] = {0x3c8bfbb395c60474ULL, 0x3193c18562a02b4cULL,
+                                      0x20323ed082572324ULL, 0x295549f54be24456ULL};
+    return seeds[base];
+  }
+  // Hash of a key, from the 8 bytes of 4 bases
+  static uint64_t base_hash(const uint64_t key) {
+    static const vector<uint64_t> table = [] {
+      vector<uint64_t> t(8 * 256, 0);
+      for (unsigned p = 0; p < 8; ++p)
+        for (unsigned byte = 0; byte < 256; ++byte)
+          for (unsigned q = 0; q < 4; ++q)
+            t[p * 256 + byte] ^= rol(seed((byte >> (2 * q)) & 3), 4 * p + q);
+      return t;
+    }();
+    uint64_t h = 0;
+    for (unsigned p = 0; p < 8; ++p)
+      h ^= table[p * 256 + ((key >> (8 * p)) & 0xff)];
+    return h;
+  }
+  static void expand(size_t *const v, const size_t n, const uint64_t h) {
+    for (size_t i = 0; i < n; i++)
+      v[i] = mix64(h + i * 0x9e3779b97f4a7c15ULL);
+  }
+  static void hash(size_t *const v, const size_t n, const uint64_t kmer) {
+    expand(v, n, base_hash(kmer));
+  }
+};
+
+/**
+ * NtHashFamily::base_hash of the canonical k-mer, rolled along a sequence:
+ * the hashes of the k-mer and of its reverse complement are updated with
+ * the base entering and the one leaving, as the k-mers are by lsappend and
+ * rsprepend, instead of hashing every key.
+ **/
+class NtHashRoller {
+public:
+  explicit NtHashRoller(const uint8_t k) : _hash(0), _rc_hash(0) {
+    const uint64_t a = NtHashFamily::seed(0);
+    for (uint64_t b = 0; b < 4; ++b) {
+      // Forward: the A above the k-mer wraps to its end, and the base
+      // leaving becomes an A
+      _in[b] = NtHashFamily::seed(b) ^ rol(a, 32);
+      _out[b] = rol(NtHashFamily::seed(b), k) ^ rol(a, k);
+      // Reverse complement: its last base wraps to the top, then an A, and
+      // the complement of the base entering replaces the A at k - 1
+      _rc_out[b] = rol(NtHashFamily::seed(reverse_char(b)), 63) ^ rol(a, 31);
+      _rc_in[b] = rol(NtHashFamily::seed(reverse_char(b)), k - 1) ^ rol(a, k - 1);
+    }
+  }
+
+  void reset(const uint64_t kmer, const uint64_t rckmer) {
+    _hash = NtHashFamily::base_hash(kmer);
+    _rc_hash = NtHashFamily::base_hash(rckmer);
+  }
+
+  // in enters at the end of the k-mer, out leaves from its start
+  void roll(const uint64_t in, const uint64_t out) {
+    _hash = rol(_hash, 1) ^ _in[in] ^ _out[out];
+    _rc_hash = rol(_rc_hash, 63) ^ _rc_out[out] ^ _rc_in[in];
+  }
+
+  // Branchless: the strand of the canonical k-mer is random
+  uint64_t hash(const uint64_t kmer, const uint64_t rckmer) const {
+    return _hash ^ ((_hash ^ _rc_hash) & -(uint64_t)(kmer > rckmer));
+  }
+
+private:
+  uint64_t _in[4], _out[4], _rc_in[4], _rc_out[4];
+  uint64_t _hash, _rc_hash;
+};
+
+#if defined(HASH_double)
+typedef DoubleHashFamily HashFamily;
+#elif defined(HASH_mix)
+typedef MixHashFamily HashFamily;
+#elif defined(HASH_nthash)
+typedef NtHashFamily HashFamily;
+#else
+typedef XXHashFamily HashFamily;
+#endif
+
+inline void _block_hashes(size_t *const v, const size_t n) {
+  for (size_t i = 1; i < n; i++)
+    v[i] = (v[0] & ~(BF_BLOCK_BITS - 1)) | (v[i] & (BF_BLOCK_BITS - 1));
+}
+
+template <typename H = HashFamily>
+inline void _get_hash(size_t *const v, const size_t n, const uint64_t& kmer, const bool blocked = false) {
+  H::hash(v, n, kmer);
+  if (blocked)
+    _block_hashes(v, n);
+}
+
+// The hashes of a key whose NtHashFamily::base_hash was rolled
+inline void _get_rolled_hash(size_t *const v, const size_t n, const uint64_t h, const bool blocked = false) {
+  NtHashFamily::expand(v, n, h);
+  if (blocked)
+    _block_hashes(v, n);
+}
+
+template <typename H = HashFamily>
+inline void _get_hash(vector<size_t> &v, const uint64_t& kmer, const bool blocked = false) {
+  _get_hash<H>(v.data(), v.size(), kmer, blocked);
 }
 
 
@@ -28,20 +28,29 @@
 #include <chrono>
 #include <cmath>
 
-#include <zlib.h>
-
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tbb/task_arena.h>
+#include "gz_reader.hpp"
 #include "kseq.h"
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(GzReader*, gz_reader_read)
 #include "common.hpp"
 #include "argument_parser.hpp"
+#include "bitsliced.hpp"
 #include "bloomtree.hpp"
+#include "exact.hpp"
 #include "BloomfilterFiller.hpp"
 #include "KmerBuilder.hpp"
 #include "FastaSplitter.hpp"
 #include "FastqSplitter.hpp"
+#include "MappedFastqSplitter.hpp"
 #include "ReadAnalyzer.hpp"
 #include "ReadOutput.hpp"
 #include "kmer_utils.hpp"
+#include "minhash.hpp"
+#include "topology.hpp"
+#include "planner.hpp"
 
 #include <fstream>
 
@@ -49,169 +58,538 @@ using namespace std;
 
 auto start_t = chrono::high_resolution_clock::now();
 
+// Size of the MinHash sketches of the similarity topology
+static const size_t SKETCH_SIZE = 128;
+
+// Peak resident memory of the process, in bytes
+uint64_t peak_memory() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t)usage.ru_maxrss << 10;
+}
+
+// Stops if a sample cannot be opened, before the index is built or loaded.
+// The sample is not opened, since it may be a pipe or a FIFO.
+void check_readable(const string &path) {
+  if (access(path.c_str(), R_OK) != 0)
+  {
+    cerr << "shark: cannot open " << path << endl << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// A reference is read twice (names or sketches, then k-mers), so it cannot
+// be a pipe
+void check_reference(const string &path) {
+  struct stat st;
+  if (path != "" && stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode))
+  {
+    cerr << "shark: the reference " << path << " is read twice, it must be a regular file" << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Reads the sequence names, and lengths if asked, from a FASTA index
+// (samtools faidx), false if there is none
+bool read_fai(const string &path, vector<string> &names, vector<uint64_t> *lengths) {
+  ifstream fai(path);
+  if (!fai)
+    return false;
+  string line;
+  while (getline(fai, line))
+    if (!line.empty())
+    {
+      const size_t tab = line.find('\t');
+      names.push_back(line.substr(0, tab));
+      if (lengths != nullptr)
+        lengths->push_back(tab == string::npos ? 0 : stoull(line.substr(tab + 1)));
+    }
+  return true;
+}
+
+// Reads the sequence names (and lengths) of a FASTA, from its .fai index if
+// there is one
+void read_names(const string &path, vector<string> &names,
+                vector<uint64_t> *lengths = nullptr) {
+  if (read_fai(path + ".fai", names, lengths))
+  {
+    // The reference is then read only once
+    if(opt::verbose)
+      cerr << "Sequence names read from " << path << ".fai" << endl;
+    return;
+  }
+  GzReader *file = new GzReader(path, opt::nThreads);
+  kseq_t *seq = kseq_init(file);
+  int seq_len;
+  while ((seq_len = kseq_read(seq)) >= 0)
+  {
+    names.push_back(string(seq->name.s));
+    if (lengths != nullptr)
+      lengths->push_back(seq_len);
+  }
+  kseq_destroy(seq);
+  delete file;
+}
+
 void pelapsed(const string &s = "") {
   auto now_t = chrono::high_resolution_clock::now();
   cerr << "[shark/" << s << "] Time elapsed "<< chrono::duration_cast<chrono::milliseconds>(now_t - start_t).count()/1000<< endl;
 }
 
 /*****************************************
- * Main
+ * Index construction
  *****************************************/
-int main(int argc, char *argv[]) {
-  parse_arguments(argc, argv);
+// Adds the sequences of a FASTA to the index, as the genes from first on of
+// the legend
+void fill_index(KmerIndex *index, const string &path, const vector<string> &legend_ID,
+                int first) {
+  {
+    int counter = first;
+    GzReader *ref_file = new GzReader(path, opt::nThreads);
+    kseq_t *refseq = kseq_init(ref_file);
 
-  // Transcripts
-  gzFile ref_file = gzopen(opt::fasta_path.c_str(), "r");
-  kseq_t *seq = kseq_init(ref_file);
-  kseq_destroy(seq);
-  gzclose(ref_file);
+    tbb::filter_t<void, vector<pair<string, string>>*>
+      tr(tbb::filter::serial_in_order, FastaSplitter(refseq, 100));
+    tbb::filter_t<vector<pair<string, string>>*, vector<pair<string,vector<uint64_t>>>*>
+      kb(tbb::filter::parallel, KmerBuilder(opt::k, index->checks_kmers() ? 0 : opt::minimizer));
+    tbb::filter_t<vector<pair<string,vector<uint64_t>>>*, gene_batch_t*>
+      gc(tbb::filter::serial_in_order, GeneCounter(counter, legend_ID));
+    tbb::filter_t<gene_batch_t*, void>
+      bff(index->concurrent_add() ? tbb::filter::parallel : tbb::filter::serial_in_order, BloomfilterFiller(index, opt::nHash));
+
+    tbb::filter_t<void, void> pipeline = tr & kb & gc & bff;
+    tbb::parallel_pipeline(opt::nThreads, pipeline);
 
-  // Sample 1
-  gzFile read1_file = gzopen(opt::sample1_path.c_str(), "r");
-  seq = kseq_init(read1_file);
-  kseq_destroy(seq);
-  gzclose(read1_file);
+    kseq_destroy(refseq);
+    delete ref_file;
+    // A stale .fai may also list sequences the reference no longer has
+    if ((size_t)counter != legend_ID.size()) {
+      cerr << "shark: the reference has " << counter - first << " sequences, "
+           << legend_ID.size() - first << " names were read before"
+           << " (is its .fai index out of date?)" << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+  tbb::task_arena(opt::nThreads).execute([&] { index->finish(); });
+}
 
-  // Sample 2
-  gzFile read2_file = nullptr;
-  if(opt::paired_flag)
+KmerIndex *build_index(vector<string> &legend_ID) {
+  /*** 1. First iteration over transcripts ***********************************/
+
+  // With the similarity topology, or with nodes sized by their k-mers, the
+  // genes are also sketched
+  const bool similarity = opt::engine == "ssbt" && opt::topology == "similarity";
+  const bool sized = opt::engine == "ssbt" && (opt::bits_per_kmer > 0 || opt::max_memory > 0);
+  vector<sketch_t> sketches;
+
+  if (similarity || sized)
   {
-    read2_file = gzopen(opt::sample2_path.c_str(), "r");
-    seq = kseq_init(read2_file);
+    GzReader *ref_file = new GzReader(opt::fasta_path, opt::nThreads);
+    kseq_t *seq = kseq_init(ref_file);
+    tbb::filter_t<void, vector<pair<string, string>>*>
+      tr(tbb::filter::serial_in_order, FastaSplitter(seq, 100));
+    tbb::filter_t<vector<pair<string, string>>*, SketchBuilder::output_t*>
+      sb(tbb::filter::parallel, SketchBuilder(opt::k, SKETCH_SIZE));
+    tbb::filter_t<SketchBuilder::output_t*, void>
+      sc(tbb::filter::serial_in_order, [&](SketchBuilder::output_t *genes) {
+        for (auto &gene : *genes) {
+          legend_ID.push_back(std::move(gene.first));
+          sketches.push_back(std::move(gene.second));
+        }
+        delete genes;
+      });
+
+    tbb::filter_t<void, void> pipeline = tr & sb & sc;
+    tbb::parallel_pipeline(opt::nThreads, pipeline);
     kseq_destroy(seq);
-    gzclose(read2_file);
+    delete ref_file;
   }
-
-  if(opt::verbose)
+  else
   {
-    cerr << "Reference texts: " << opt::fasta_path << endl;
-    cerr << "Sample 1: " << opt::sample1_path << endl;
-    if(opt::paired_flag)
-      cerr << "Sample 2: " << opt::sample2_path << endl;
-    cerr << "K-mer length: " << opt::k << endl;
-    cerr << "Threshold value: " << opt::c << endl;
-    cerr << "Only single associations: " << (opt::single ? "Yes" : "No") << endl;
-    cerr << "Minimum base quality: " << static_cast<int>(opt::min_quality) << endl;
-    cerr << endl;
+    read_names(opt::fasta_path, legend_ID);
   }
 
   /****************************************************************************/
 
-  /*** 1. First iteration over transcripts ***********************************/
-
-  vector<string> legend_ID;
-
-  ref_file = gzopen(opt::fasta_path.c_str(), "r");
-  seq = kseq_init(ref_file);
-  int seq_len;
+  const size_t nidx = legend_ID.size();
+  if (nidx == 0) {
+    cerr << "shark: no sequences found in " << opt::fasta_path << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
 
-  while ((seq_len = kseq_read(seq)) >= 0)
+  KmerIndex *index;
+  if (opt::engine == "bitsliced")
   {
-    legend_ID.push_back(string(seq->name.s));
+    // One filter of bf_size bits per gene, as the deepest leaves of a tree
+    index = new BitSlicedIndex(nidx, opt::bf_size);
   }
-  kseq_destroy(seq);
-  gzclose(ref_file);
+  else if (opt::engine == "exact")
+  {
+    // With minimizers, the k-mers are bucketed by minimizer at the end
+    index = new ExactIndex(nidx, opt::k, opt::minimizer);
+  }
+  else
+  {
+    auto topology_t = chrono::high_resolution_clock::now();
+    const merges_t merges = !similarity ? fifo_topology(nidx)
+                            : sized ? similarity_topology(sketches, SKETCH_SIZE)
+                                    : similarity_topology(std::move(sketches), SKETCH_SIZE);
+    vector<uint64_t> sizes;
+    if (sized)
+    {
+      const vector<uint64_t> kmers = subtree_kmers(std::move(sketches), merges, SKETCH_SIZE);
+      if (opt::max_memory > 0)
+      {
+        // Every node takes at least a word (a block if blocked)
+        const uint64_t min_bytes = SSBT::node_size(1, opt::bf_type == "blocked") / 8 * kmers.size();
+        if ((opt::max_memory << 20) < min_bytes)
+        {
+          cerr << "shark: " << opt::max_memory << " MB cannot hold the " << kmers.size()
+               << " bloom filters of the tree, at least " << ((min_bytes - 1) >> 20) + 1
+               << " MB are needed" << endl
+               << "aborting..." << endl;
+          exit(EXIT_FAILURE);
+        }
+        const index_plan_t plan = plan_index(merges, kmers, opt::max_memory << 20, opt::fpr,
+                                             opt::bf_type == "blocked");
+        opt::bits_per_kmer = plan.bits_per_kmer;
+        opt::nHash = plan.nHash;
+        cerr << "Plan for " << opt::max_memory << " MB: " << plan.bits_per_kmer
+             << " bits per k-mer, " << plan.nHash << " hash functions, "
+             << plan.bytes / (1 << 20) << " MB, false positive rate " << plan.fpr
+             << ", nodes visited per k-mer " << plan.probes_absent << " (absent) / "
+             << plan.probes_present << " (in one gene)" << endl;
+        if (opt::fpr > 0 && plan.fpr > opt::fpr * 1.001)
+          cerr << "shark: the false positive rate " << opt::fpr
+               << " cannot be reached in " << opt::max_memory << " MB" << endl;
+      }
+      for (const auto n : kmers)
+        sizes.push_back(ceil(n * opt::bits_per_kmer));
+    }
+    index = new SSBT(nidx, merges, opt::bf_size, opt::bf_type == "blocked", sizes);
+
+    if(opt::verbose)
+      cerr << "Tree topology (" << opt::topology << ") built in "
+           << chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - topology_t).count()
+           << " ms" << endl;
+  }
+
+  pelapsed("BF created from transcripts (" + to_string(nidx) + " genes)");
 
   /****************************************************************************/
 
-  const size_t nidx = legend_ID.size();
-  deque<pair<SimpleBF *, size_t>> coda;
-  vector<SimpleBF *> leaves;
-  leaves.reserve(nidx);
-  for (size_t i = 0; i < nidx; i++) {
-    SimpleBF *node = new SimpleBF(i);
-    coda.emplace_back(node, opt::bf_size);
-    leaves.push_back(node);
+  /*** 2. Second iteration over transcripts ************************************/
+
+  fill_index(index, opt::fasta_path, legend_ID, 0);
+
+  pelapsed("Transcript file processed");
+
+  return index;
+}
+
+KmerIndex *load_index(const string &path, vector<string> &legend_ID) {
+  MappedFile *mapping;
+  const index_header_t &header = map_index(path, mapping, legend_ID, opt::k, opt::nHash, opt::minimizer);
+  if (opt::minimizer > 0 && !(header.flags & INDEX_EXACT))
+    KmerIndex::fail_load(path, "index keyed on minimizers, which require the exact engine");
+  if (header.flags & INDEX_BITSLICED)
+    return BitSlicedIndex::load(path, mapping, header);
+  if (header.flags & INDEX_EXACT)
+    return ExactIndex::load(path, mapping, header);
+  return SSBT::load(path, mapping, header);
+}
+
+/*****************************************
+ * Index update
+ *****************************************/
+KmerIndex *update_index(vector<string> &legend_ID) {
+  vector<string> old_legend;
+  KmerIndex *base = load_index(opt::index_path, old_legend);
+  const SSBT *tree = dynamic_cast<const SSBT *>(base);
+  if (tree == nullptr) {
+    cerr << "shark: only the indexes of the ssbt engine can be updated" << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
   }
 
-  while (coda.size() > 1) {
-    auto sx = coda.front();
-    coda.pop_front();
-    auto dx = coda.front();
-    coda.pop_front();
+  map<string, size_t> genes;
+  for (size_t i = 0; i < old_legend.size(); ++i)
+    genes[old_legend[i]] = i;
+  vector<bool> removed(old_legend.size(), false);
+  if (opt::remove_path != "") {
+    ifstream names(opt::remove_path);
+    if (!names) {
+      cerr << "shark: cannot read " << opt::remove_path << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    string name;
+    while (names >> name) {
+      auto gene = genes.find(name);
+      if (gene == genes.end()) {
+        cerr << "shark: gene " << name << " is not in the index" << endl
+             << "aborting..." << endl;
+        exit(EXIT_FAILURE);
+      }
+      removed[gene->second] = true;
+      genes.erase(gene);
+    }
+  }
+  for (size_t i = 0; i < old_legend.size(); ++i)
+    if (!removed[i])
+      legend_ID.push_back(std::move(old_legend[i]));
+  const size_t n_kept = legend_ID.size();
+
+  vector<uint64_t> lengths;
+  if (opt::add_path != "")
+    read_names(opt::add_path, legend_ID, &lengths);
+  for (size_t i = n_kept; i < legend_ID.size(); ++i)
+    if (!genes.emplace(legend_ID[i], i).second) {
+      cerr << "shark: gene " << legend_ID[i] << " is already in the index" << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
 
-    coda.emplace_back(new SimpleBF(sx.first, dx.first),
-                      2 * std::max(sx.second, dx.second));
+  // K-mers of the new genes, for the indexes sized by k-mers
+  vector<uint64_t> kmers;
+  for (const auto length : lengths)
+    kmers.push_back(length >= opt::k ? length - opt::k + 1 : 1);
+  SSBT *index = new SSBT(*tree, removed, kmers, opt::nHash);
+  delete base;
+  pelapsed("Index updated (" + to_string(old_legend.size() - n_kept) + " genes removed)");
+
+  if (legend_ID.size() > n_kept) {
+    fill_index(index, opt::add_path, legend_ID, n_kept);
+    pelapsed("Added " + to_string(legend_ID.size() - n_kept) + " genes");
   }
+  return index;
+}
 
-  coda.front().first->resize(coda.front().second);
+/*****************************************
+ * Index merge
+ *****************************************/
+KmerIndex *merge_indexes(vector<string> &legend_ID) {
+  vector<KmerIndex *> shards;
+  vector<const SSBT *> trees;
+  uint k = 0, minimizer = 0;
+  int nHash = 0;
+  for (const auto &path : opt::shard_paths) {
+    vector<string> legend;
+    shards.push_back(load_index(path, legend));
+    trees.push_back(dynamic_cast<const SSBT *>(shards.back()));
+    if (trees.back() == nullptr) {
+      cerr << "shark: only the indexes of the ssbt engine can be merged (" << path << ")" << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (shards.size() == 1) {
+      k = opt::k;
+      nHash = opt::nHash;
+      minimizer = opt::minimizer;
+    } else if (opt::k != k || opt::nHash != nHash || opt::minimizer != minimizer) {
+      cerr << "shark: " << path << " has a different k, number of hash functions or minimizer length"
+           << endl << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    legend_ID.insert(legend_ID.end(), legend.begin(), legend.end());
+  }
 
-  SSBT tree(coda.front().first);
-  coda.pop_front();
+  vector<string> names(legend_ID);
+  sort(names.begin(), names.end());
+  const auto repeated = adjacent_find(names.begin(), names.end());
+  if (repeated != names.end()) {
+    cerr << "shark: gene " << *repeated << " is in more than one index" << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
 
-  pelapsed("BF created from transcripts (" + to_string(nidx) + " genes)");
+  KmerIndex *index = new SSBT(trees, nHash);
+  for (const auto shard : shards)
+    delete shard;
+  pelapsed("Merged " + to_string(trees.size()) + " indexes (" + to_string(legend_ID.size()) + " genes)");
+  return index;
+}
 
-  /****************************************************************************/
+/*****************************************
+ * Main
+ *****************************************/
+int main(int argc, char *argv[]) {
+  parse_arguments(argc, argv);
 
-  /*** 2. Second iteration over transcripts ************************************/
+  GzReader *read1_file = nullptr;
+  GzReader *read2_file = nullptr;
 
+  check_reference(opt::fasta_path);
+  check_reference(opt::add_path);
+  if(!opt::build_index)
   {
-    int counter = 0;
-    ref_file = gzopen(opt::fasta_path.c_str(), "r");
-    kseq_t *refseq = kseq_init(ref_file);
-
-    tbb::filter_t<void, vector<pair<string, string>>*>
-      tr(tbb::filter::serial_in_order, FastaSplitter(refseq, 100));
-    tbb::filter_t<vector<pair<string, string>>*, vector<pair<string,vector<size_t>>>*>
-      kb(tbb::filter::parallel, KmerBuilder(opt::k, tree.size(), opt::nHash));
-    tbb::filter_t<vector<pair<string,vector<size_t>>>*, void>
-      bff(tbb::filter::serial_in_order, BloomfilterFiller(&tree, counter, leaves));
+    check_readable(opt::sample1_path);
+    if(opt::paired_flag)
+      check_readable(opt::sample2_path);
+  }
 
-    tbb::filter_t<void, void> pipeline = tr & kb & bff;
-    tbb::parallel_pipeline(opt::nThreads, pipeline);
+  vector<string> legend_ID;
+  KmerIndex *index;
+  const bool update = opt::add_path != "" || opt::remove_path != "";
+  if(opt::fasta_path != "")
+  {
+    index = build_index(legend_ID);
+  }
+  else if(update)
+  {
+    index = update_index(legend_ID);
+  }
+  else if(opt::merge)
+  {
+    index = merge_indexes(legend_ID);
+  }
+  else
+  {
+    index = load_index(opt::index_path, legend_ID);
+    pelapsed("Index loaded (" + to_string(legend_ID.size()) + " genes)");
+  }
 
-    kseq_destroy(refseq);
-    gzclose(ref_file);
+  if(opt::verbose)
+  {
+    if(opt::fasta_path != "")
+      cerr << "Reference texts: " << opt::fasta_path << endl;
+    if(opt::index_path != "")
+      cerr << "Index: " << opt::index_path << endl;
+    if(!opt::build_index)
+    {
+      cerr << "Sample 1: " << opt::sample1_path << endl;
+      if(opt::paired_flag)
+        cerr << "Sample 2: " << opt::sample2_path << endl;
+    }
+    cerr << "K-mer length: " << opt::k << endl;
+    if(opt::minimizer > 0)
+      cerr << "Minimizer length: " << opt::minimizer << endl;
+    cerr << "Hash functions: " << opt::nHash << " (" << HashFamily::name() << ")" << endl;
+    cerr << "Engine: " << index->engine() << " (" << index->bytes() / (1 << 20) << " MB)" << endl;
+    if(opt::fasta_path != "" || update || opt::merge)
+    {
+      cerr << "Peak memory while building: " << peak_memory() / (1 << 20) << " MB" << endl;
+      index->print_stats(cerr);
+    }
+    cerr << "Bloom filters: " << (index->blocked() ? "blocked" : "simple") << endl;
+    if(opt::fasta_path != "" && opt::bits_per_kmer > 0)
+      cerr << "Bits per k-mer: " << opt::bits_per_kmer << endl;
+    if(!opt::build_index)
+    {
+      cerr << "Threshold value: " << opt::c << endl;
+      cerr << "Only single associations: " << (opt::single ? "Yes" : "No") << endl;
+      cerr << "Minimum base quality: " << static_cast<int>(opt::min_quality) << endl;
+    }
+    cerr << endl;
   }
 
-  pelapsed("Transcript file processed");
+  if(opt::build_index)
+  {
+    // Replaced at once, a mapped index is never overwritten
+    const string tmp_path = opt::index_path + ".tmp";
+    index->save(tmp_path, legend_ID, opt::k, opt::nHash, opt::minimizer);
+    if (rename(tmp_path.c_str(), opt::index_path.c_str()) != 0) {
+      cerr << "shark: cannot write index " << opt::index_path << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    delete index;
+    pelapsed("Index stored in " + opt::index_path);
+    return 0;
+  }
 
   /****************************************************************************/
 
   /*** 3. Iteration over the sample *****************************************/
   // IF (FASE 1) COMMENT FROM HERE
 
+  query_stats_t stats;
+  auto sample_t = chrono::high_resolution_clock::now();
   {
     kseq_t *sseq1 = nullptr, *sseq2 = nullptr;
     FILE *out1 = nullptr, *out2 = nullptr;
-    read1_file = gzopen(opt::sample1_path.c_str(), "r");
-    sseq1 = kseq_init(read1_file);
     if (opt::out1_path != "")
       out1 = fopen(opt::out1_path.c_str(), "w");
-    if(opt::paired_flag)
+    if(opt::paired_flag && opt::out2_path != "")
+      out2 = fopen(opt::out2_path.c_str(), "w");
+
+    // Uncompressed FASTQ samples are mapped in memory and parsed in parallel
+    MappedFile *sample1 = new MappedFile(opt::sample1_path);
+    MappedFile *sample2 = opt::paired_flag ? new MappedFile(opt::sample2_path) : nullptr;
+    const bool mapped = is_mapped_fastq(*sample1) && (sample2 == nullptr || is_mapped_fastq(*sample2));
+    if (!mapped)
     {
-      read2_file = gzopen(opt::sample2_path.c_str(), "r");
-      sseq2 = kseq_init(read2_file);
-      if (opt::out2_path != "")
-        out2 = fopen(opt::out2_path.c_str(), "w");
+      delete sample1;
+      delete sample2;
+      sample1 = sample2 = nullptr;
+      read1_file = new GzReader(opt::sample1_path, opt::nThreads);
+      sseq1 = kseq_init(read1_file);
+      if(opt::paired_flag)
+      {
+        read2_file = new GzReader(opt::sample2_path, opt::nThreads);
+        sseq2 = kseq_init(read2_file);
+      }
     }
+    if(opt::verbose)
+      cerr << "Samples " << (mapped ? "mapped in memory" : "read by kseq") << endl;
 
-    tbb::filter_t<void, FastqSplitter::output_t*>
-      sr(tbb::filter::serial_in_order, FastqSplitter(sseq1, sseq2, 50000, opt::min_quality, out1 != nullptr));
+    ReadBatchPool pool;
     tbb::filter_t<FastqSplitter::output_t*, ReadAnalyzer::output_t*>
-      ra(tbb::filter::parallel, ReadAnalyzer(&tree, legend_ID, opt::k, opt::c, opt::single, opt::method, opt::nHash));
+      ra(tbb::filter::parallel, ReadAnalyzer(index, legend_ID, opt::k, opt::c, opt::single, opt::method, opt::nHash, &stats, opt::minimizer));
+    tbb::filter_t<ReadAnalyzer::output_t*, ReadAnalyzer::output_t*>
+      rf(tbb::filter::parallel, ReadFormatter(out1 != nullptr, out2 != nullptr, opt::bgzf));
     tbb::filter_t<ReadAnalyzer::output_t*, void>
-      so(tbb::filter::serial_in_order, ReadOutput(out1, out2));
-
-    tbb::filter_t<void, void> pipeline_reads = sr & ra & so;
+      so(tbb::filter::serial_in_order, ReadOutput(pool, out1, out2));
+
+    tbb::filter_t<void, void> pipeline_reads = mapped
+      ? tbb::filter_t<void, FastqSplitter::output_t*>(tbb::filter::serial_in_order, MappedFastqSplitter(pool, *sample1, sample2, 50000))
+        & tbb::filter_t<FastqSplitter::output_t*, FastqSplitter::output_t*>(tbb::filter::parallel, FastqParser(*sample1, sample2, opt::min_quality, out1 != nullptr))
+        & ra & rf & so
+      : tbb::filter_t<void, FastqSplitter::output_t*>(tbb::filter::serial_in_order, FastqSplitter(pool, sseq1, sseq2, 50000, opt::min_quality, out1 != nullptr))
+        & ra & rf & so;
     tbb::parallel_pipeline(opt::nThreads, pipeline_reads);
 
-    kseq_destroy(sseq1);
-    gzclose(read1_file);
-    if(opt::paired_flag)
+    if (mapped)
+    {
+      delete sample1;
+      delete sample2;
+    }
+    else
     {
-      kseq_destroy(sseq2);
-      gzclose(read2_file);
+      kseq_destroy(sseq1);
+      delete read1_file;
+      if(opt::paired_flag)
+      {
+        kseq_destroy(sseq2);
+        delete read2_file;
+      }
     }
+    if (opt::bgzf)
+      for (FILE *out : {stdout, out1, out2})
+        if (out != nullptr)
+          fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out);
     if (out1 != nullptr) fclose(out1);
     if (out2 != nullptr) fclose(out2);
   }
 
   pelapsed("Sample completed");
 
+  if(opt::verbose && stats.kmers > 0)
+  {
+    const double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - sample_t).count();
+    cerr << "Nodes visited per k-mer: " << (double)stats.probes / stats.kmers
+         << " (" << stats.kmers << " k-mers)" << endl;
+    cerr << "Query throughput: " << (uint64_t)(stats.kmers / seconds) << " k-mers/s" << endl;
+  }
+
   // IF (FASE 1) COMMENT UNTIL HERE
   /****************************************************************************/
 
+  delete index;
+
   pelapsed("Association done");
 
   return 0;
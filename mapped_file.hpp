@@ -0,0 +1,72 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+
+// Read-only, shared mapping of a whole file. Since the mapping is shared,
+// concurrent processes opening the same file use the same page cache.
+// Only regular files are opened, a pipe or a FIFO is left to be read once.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path)
+      : _data(nullptr), _size(0) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return;
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED) {
+        _data = static_cast<const uint8_t *>(addr);
+        _size = st.st_size;
+        madvise(addr, _size, MADV_WILLNEED);
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (_data != nullptr)
+      munmap(const_cast<uint8_t *>(_data), _size);
+  }
+
+  bool is_open() const { return _data != nullptr; }
+  const uint8_t *data() const { return _data; }
+  size_t size() const { return _size; }
+
+  MappedFile(const MappedFile &) = delete;
+  const MappedFile &operator=(const MappedFile &) = delete;
+
+private:
+  const uint8_t *_data;
+  size_t _size;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MINHASH_HPP
+#define MINHASH_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "kmer_utils.hpp"
+
+using namespace std;
+
+// Bottom-s MinHash sketch: the s smallest hashes of the canonical k-mers of
+// a sequence, sorted and without duplicates.
+typedef vector<uint64_t> sketch_t;
+
+static const uint64_t MINHASH_SEED = 0x5ead5eed;
+
+inline void merge_sketches(const sketch_t &a, const sketch_t &b,
+                           const size_t s, sketch_t &out) {
+  out.clear();
+  set_union(a.begin(), a.end(), b.begin(), b.end(), back_inserter(out));
+  if (out.size() > s)
+    out.resize(s);
+}
+
+// Number of distinct k-mers estimated on a bottom-s sketch: exact if the
+// sketch is not full, otherwise from the largest hash it keeps
+inline uint64_t sketch_cardinality(const sketch_t &a, const size_t s) {
+  if (a.size() < s)
+    return a.size();
+  return (uint64_t)((s - 1) * (18446744073709551616.0L / ((long double)a.back() + 1)));
+}
+
+// Jaccard similarity estimated on the bottom-s sketch of the union
+inline double jaccard(const sketch_t &a, const sketch_t &b, const size_t s) {
+  size_t shared = 0, seen = 0;
+  auto i = a.begin(), j = b.begin();
+  while (seen < s && (i != a.end() || j != b.end())) {
+    if (j == b.end() || (i != a.end() && *i < *j)) {
+      ++i;
+    } else if (i == a.end() || *j < *i) {
+      ++j;
+    } else {
+      ++shared;
+      ++i;
+      ++j;
+    }
+    ++seen;
+  }
+  return seen == 0 ? 0 : (double)shared / seen;
+}
+
+class SketchBuilder {
+public:
+  typedef vector<pair<string, sketch_t>> output_t;
+
+  SketchBuilder(const uint8_t _k, const size_t _s) : k(_k), s(_s) {}
+
+  output_t *operator()(vector<pair<string, string>> *texts) const {
+    output_t *ret = new output_t();
+    ret->reserve(texts->size());
+    sketch_t hashes;
+    for (const auto &p : *texts) {
+      hashes.clear();
+      for_each_kmer(p.second, k, [&](const uint64_t kmer, const int) {
+        hashes.push_back(xxh::xxhash<64>(&kmer, sizeof(uint64_t), MINHASH_SEED));
+      });
+      sort(hashes.begin(), hashes.end());
+      hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+      if (hashes.size() > s)
+        hashes.resize(s);
+      ret->emplace_back(p.first, hashes);
+    }
+    delete texts;
+    return ret;
+  }
+
+private:
+  const uint8_t k;
+  const size_t s;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef PLANNER_HPP
+#define PLANNER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "bloomtree.hpp"
+
+using namespace std;
+
+// Parameters of a tree sized by k-mers, and their predicted cost
+struct index_plan_t {
+  double bits_per_kmer;
+  int nHash;
+  uint64_t bytes;        // of the filters
+  double fpr;            // of every node
+  double probes_absent;  // nodes visited by a k-mer of no gene
+  double probes_present; // nodes visited by a k-mer of a single gene
+};
+
+// False positive rate of a filter with nHash hash functions
+inline double bloom_fpr(const double bits_per_kmer, const int nHash) {
+  return pow(1 - exp(-nHash / bits_per_kmer), nHash);
+}
+
+/**
+ * Picks the bits per k-mer and the number of hash functions of a tree
+ * (numbered as in merges_t) with kmers[i] distinct k-mers below node i:
+ * the smallest filters reaching the target false positive rate, if they
+ * fit in max_bytes, otherwise the largest filters fitting in max_bytes.
+ * The number of hash functions is the optimal one, up to max_hash.
+ **/
+inline index_plan_t plan_index(const merges_t &merges, const vector<uint64_t> &kmers,
+                               const uint64_t max_bytes, const double target_fpr,
+                               const bool blocked, const int max_hash = 8) {
+  auto bytes = [&](const double bits_per_kmer) {
+    uint64_t bits = 0;
+    for (const auto n : kmers)
+      bits += SSBT::node_size(ceil(n * bits_per_kmer), blocked);
+    return bits / 8;
+  };
+
+  index_plan_t plan;
+  uint64_t total = 0;
+  for (const auto n : kmers)
+    total += n;
+  plan.bits_per_kmer = max_bytes * 8.0 / max(total, (uint64_t)1);
+  // Rounding up the sizes takes a little more than planned
+  for (int i = 0; i < 8 && bytes(plan.bits_per_kmer) > max_bytes; ++i)
+    plan.bits_per_kmer *= (double)max_bytes / bytes(plan.bits_per_kmer);
+  plan.nHash = max(1, min(max_hash, (int)lround(plan.bits_per_kmer * M_LN2)));
+  if (target_fpr > 0) {
+    const int nHash = max(1, min(max_hash, (int)lround(-log2(target_fpr))));
+    const double bits_per_kmer = -nHash / log(1 - pow(target_fpr, 1.0 / nHash));
+    if (bits_per_kmer < plan.bits_per_kmer) {
+      plan.bits_per_kmer = bits_per_kmer;
+      plan.nHash = nHash;
+    }
+  }
+  plan.bytes = bytes(plan.bits_per_kmer);
+  plan.fpr = bloom_fpr(plan.bits_per_kmer, plan.nHash);
+
+  // absent[i]: nodes visited in the subtree of i by a k-mer that is not
+  // in it, once i is visited; present[i]: the same for a k-mer of one of
+  // its genes, averaged on the genes
+  const size_t n_genes = kmers.size() - merges.size();
+  vector<double> absent(kmers.size(), 1), present(kmers.size(), 1);
+  vector<uint64_t> genes(kmers.size(), 1);
+  for (size_t j = 0; j < merges.size(); ++j) {
+    const uint32_t l = merges[j].first, r = merges[j].second;
+    const size_t i = n_genes + j;
+    absent[i] = 1 + plan.fpr * (absent[l] + absent[r]);
+    genes[i] = genes[l] + genes[r];
+    present[i] = 1 + (genes[l] * (present[l] + absent[r]) +
+                      genes[r] * (present[r] + absent[l])) / genes[i];
+  }
+  plan.probes_absent = absent.back();
+  plan.probes_present = present.back();
+  return plan;
+}
+
+#endif
@@ -22,52 +22,26 @@
 #ifndef _BLOOM_FILTER_HPP
 #define _BLOOM_FILTER_HPP
 
-#include <vector>
+#include <cstdint>
 
-#include "kmer_utils.hpp"
+#include "bitvector.hpp"
 
-class SSBT;
-
-class SimpleBF {
-  friend class SSBT;
-
-public:
-  SimpleBF(const int id_gene = -1)
-      : sx(nullptr), dx(nullptr), parent(nullptr), _bf(0, false), _id(id_gene) {
-  }
-
-  SimpleBF(SimpleBF *_sx, SimpleBF *_dx)
-      : sx(_sx), dx(_dx), parent(nullptr), _bf(sx->size() * 2, false), _id(-1) {
-    _sx->parent = this;
-    _dx->parent = this;
-  }
-
-  ~SimpleBF() {
-    delete sx;
-    delete dx;
-  }
-
-  void add_at(const uint64_t p) { _bf[p & (_bf.size() - 1)] = true; }
-
-  SimpleBF *get_parent() const { return parent; }
-
-  size_t size() const { return _bf.size(); };
-  void resize(const size_t size) {
-    if (size == _bf.size()) return;
-    _bf.clear();
-    _bf.resize(size, false);
-    if (sx != nullptr) sx->resize(size >> 1);
-    if (dx != nullptr) dx->resize(size >> 1);
-  }
-
-private:
-  typedef std::vector<bool> bit_vector_t;
-
-  SimpleBF *const sx;
-  SimpleBF *const dx;
-  SimpleBF *parent;
-  bit_vector_t _bf;
-  const int _id;
+/**
+ * Node of the flattened bloom tree. Nodes are stored in a single array in
+ * BFS order, so the two children of a node are adjacent and a whole level
+ * is contiguous, and the filters live in a single slab of 64-bit words.
+ * The struct has no pointers and it is written to disk as is.
+ **/
+struct SimpleBF {
+  uint64_t offset; // first word of the filter in the slab
+  uint64_t size;   // size of the filter in bits (a power of 2, unless ranged)
+  uint32_t child;  // index of the left child (right is child + 1), 0 for leaves
+  int32_t id;      // gene index for leaves, -1 for internal nodes
+
+  bool is_leaf() const { return child == 0; }
+  uint64_t words() const { return (size + 63) >> 6; }
 };
 
+static_assert(sizeof(SimpleBF) == 24, "SimpleBF is stored on disk as is");
+
 #endif
@@ -0,0 +1,159 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2019 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+#include <algorithm>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "bloomtree.hpp"
+#include "minhash.hpp"
+
+using namespace std;
+
+// Distinct k-mers below every node of a tree (numbered as in merges_t),
+// estimated on the union of the sketches of the genes
+vector<uint64_t> subtree_kmers(vector<sketch_t> sketches, const merges_t &merges,
+                               const size_t s) {
+  const size_t n = sketches.size();
+  sketches.resize(n + merges.size());
+  for (size_t j = 0; j < merges.size(); ++j)
+    merge_sketches(sketches[merges[j].first], sketches[merges[j].second], s,
+                   sketches[n + j]);
+  vector<uint64_t> kmers(sketches.size());
+  for (size_t i = 0; i < sketches.size(); ++i)
+    kmers[i] = sketch_cardinality(sketches[i], s);
+  return kmers;
+}
+
+// Pairs the nodes in FASTA order, as a FIFO queue
+merges_t fifo_topology(const size_t n) {
+  deque<uint32_t> coda;
+  merges_t merges;
+  merges.reserve(n - 1);
+  for (size_t i = 0; i < n; i++)
+    coda.push_back(i);
+
+  while (coda.size() > 1) {
+    auto sx = coda.front();
+    coda.pop_front();
+    auto dx = coda.front();
+    coda.pop_front();
+
+    merges.emplace_back(sx, dx);
+    coda.push_back(n + merges.size() - 1);
+  }
+  return merges;
+}
+
+/**
+ * Builds the tree bottom-up, one level at a time: at each level the most
+ * similar pairs of nodes (Jaccard on their MinHash sketches) are merged
+ * first, then the remaining nodes are paired in order. Every level halves
+ * the number of nodes, so the tree stays as balanced as the FIFO one.
+ * Candidate pairs are the nodes sharing at least one sketch value; values
+ * shared by more than max_bucket nodes are not used to find candidates.
+ **/
+merges_t similarity_topology(vector<sketch_t> sketches, const size_t s,
+                             const size_t max_bucket = 64) {
+  const size_t n = sketches.size();
+  merges_t merges;
+  merges.reserve(n - 1);
+
+  vector<uint32_t> level(n); // tree nodes of the current level
+  for (size_t i = 0; i < n; ++i)
+    level[i] = i;
+
+  unordered_map<uint64_t, vector<uint32_t>> buckets;
+  vector<pair<double, pair<uint32_t, uint32_t>>> candidates;
+  vector<bool> matched;
+  while (level.size() > 1) {
+    const size_t m = level.size();
+
+    buckets.clear();
+    for (size_t i = 0; i < m; ++i)
+      for (const auto h : sketches[i])
+        buckets[h].push_back(i);
+
+    candidates.clear();
+    for (const auto &bucket : buckets) {
+      const auto &items = bucket.second;
+      if (items.size() < 2 || items.size() > max_bucket)
+        continue;
+      for (size_t a = 0; a < items.size(); ++a)
+        for (size_t b = a + 1; b < items.size(); ++b)
+          candidates.push_back({0, {items[a], items[b]}});
+    }
+    sort(candidates.begin(), candidates.end(),
+         [](const pair<double, pair<uint32_t, uint32_t>> &a,
+            const pair<double, pair<uint32_t, uint32_t>> &b) { return a.second < b.second; });
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+    for (auto &c : candidates)
+      c.first = jaccard(sketches[c.second.first], sketches[c.second.second], s);
+    stable_sort(candidates.begin(), candidates.end(),
+                [](const pair<double, pair<uint32_t, uint32_t>> &a,
+                   const pair<double, pair<uint32_t, uint32_t>> &b) { return a.first > b.first; });
+
+    vector<pair<uint32_t, uint32_t>> pairs;
+    matched.assign(m, false);
+    for (const auto &c : candidates) {
+      const auto a = c.second.first, b = c.second.second;
+      if (!matched[a] && !matched[b]) {
+        matched[a] = matched[b] = true;
+        pairs.emplace_back(a, b);
+      }
+    }
+    int single = -1;
+    for (size_t i = 0; i < m; ++i) {
+      if (matched[i])
+        continue;
+      if (single < 0) {
+        single = i;
+      } else {
+        pairs.emplace_back(single, i);
+        single = -1;
+      }
+    }
+
+    vector<uint32_t> next;
+    vector<sketch_t> next_sketches;
+    next.reserve(pairs.size() + 1);
+    next_sketches.reserve(pairs.size() + 1);
+    for (const auto &p : pairs) {
+      merges.emplace_back(level[p.first], level[p.second]);
+      next.push_back(n + merges.size() - 1);
+      next_sketches.emplace_back();
+      merge_sketches(sketches[p.first], sketches[p.second], s, next_sketches.back());
+    }
+    if (single >= 0) {
+      next.push_back(level[single]);
+      next_sketches.push_back(std::move(sketches[single]));
+    }
+    level.swap(next);
+    sketches.swap(next_sketches);
+  }
+  return merges;
+}
+
+#endif